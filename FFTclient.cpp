@@ -0,0 +1,223 @@
+/*
+	Test client for the FFTconvolve render daemon
+
+	Usage: ./FFTclient socketPath RENDER inputFile irFile outputFile
+	       ./FFTclient socketPath PCM inputFile irFile outputFile
+	       ./FFTclient socketPath STATS
+	       ./FFTclient socketPath SHUTDOWN
+
+	RENDER passes the input path to the daemon. Paths are made absolute
+	first, since the daemon resolves them against its own working
+	directory. PCM reads the samples of
+	inputFile here and sends them inline with its sample rate, channel
+	count and sample format, so the daemon never opens it. The daemon's
+	one-line reply is printed to stdout
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+// Format codes in the fmt chunk
+#define WAVE_FORMAT_PCM			1
+#define WAVE_FORMAT_IEEE_FLOAT	3
+#define WAVE_FORMAT_EXTENSIBLE	0xFFFE
+
+//what the daemon needs to know to decode the inline samples
+struct pcmLayout
+{
+    int             sampleRate;
+    int             channels;
+    int             bytesPerFrame;
+    const char     *format;
+};
+
+/*
+Maps a fmt chunk's format code and sample size to the daemon's name for
+it, or nullptr if the daemon cannot decode it
+*/
+const char *formatName(int code, int bits) {
+
+    if (code == WAVE_FORMAT_PCM && bits == 16) {
+        return "int16";
+    }
+    if (code == WAVE_FORMAT_PCM && bits == 24) {
+        return "int24";
+    }
+    if (code == WAVE_FORMAT_PCM && bits == 32) {
+        return "int32";
+    }
+    if (code == WAVE_FORMAT_IEEE_FLOAT && bits == 32) {
+        return "float";
+    }
+    return nullptr;
+}
+
+/*
+Returns the raw bytes of the data chunk of a wav file and fills in layout
+from its fmt chunk. Prints why and returns an empty vector if the file
+cannot be read or its format is not one the daemon accepts
+*/
+std::vector<uint8_t> readDataChunk(char *filename, pcmLayout *layout) {
+
+    std::vector<uint8_t> data;
+    FILE *inputFile = fopen(filename, "rb");
+    if (inputFile == nullptr) {
+        fprintf(stderr, "Unable to open wav file: %s\n", filename);
+        return data;
+    }
+
+    char riff[12];
+    if (fread(riff, 1, 12, inputFile) != 12 || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+        fprintf(stderr, "Not a RIFF wav file: %s\n", filename);
+        fclose(inputFile);
+        return data;
+    }
+
+    //Walk the chunks, taking the layout from fmt and the samples from data
+    layout->format = nullptr;
+    char id[4];
+    uint32_t size;
+    while (fread(id, 1, 4, inputFile) == 4 && fread(&size, 4, 1, inputFile) == 1) {
+        if (memcmp(id, "fmt ", 4) == 0 && size >= 16) {
+            uint8_t fmt[40] = {0};
+            if (fread(fmt, 1, min((uint32_t)sizeof(fmt), size), inputFile) != min((uint32_t)sizeof(fmt), size)) {
+                break;
+            }
+            int code = fmt[0] | (fmt[1] << 8);
+            layout->channels = fmt[2] | (fmt[3] << 8);
+            layout->sampleRate = fmt[4] | (fmt[5] << 8) | (fmt[6] << 16) | (fmt[7] << 24);
+            layout->bytesPerFrame = fmt[12] | (fmt[13] << 8);
+            int bits = fmt[14] | (fmt[15] << 8);
+
+            //WAVE_FORMAT_EXTENSIBLE keeps the real code at the start of its sub-format GUID
+            if (code == WAVE_FORMAT_EXTENSIBLE && size >= 40) {
+                code = fmt[24] | (fmt[25] << 8);
+            }
+            layout->format = formatName(code, bits);
+            if (layout->format == nullptr || layout->channels < 1 || layout->bytesPerFrame != layout->channels * bits / 8) {
+                fprintf(stderr, "Unsupported sample format in %s\n", filename);
+                layout->format = nullptr;
+                break;
+            }
+            fseek(inputFile, size - min((uint32_t)sizeof(fmt), size) + (size & 1), SEEK_CUR);
+        } else if (memcmp(id, "data", 4) == 0 && layout->format != nullptr) {
+            data.resize(size - size % layout->bytesPerFrame);
+            data.resize(fread(data.data(), 1, data.size(), inputFile));
+            data.resize(data.size() - data.size() % layout->bytesPerFrame);
+            break;
+        } else {
+            fseek(inputFile, size + (size & 1), SEEK_CUR);
+        }
+    }
+
+    if (layout->format != nullptr && data.empty()) {
+        fprintf(stderr, "No sample data in %s\n", filename);
+    }
+    fclose(inputFile);
+    return data;
+}
+
+/*
+Returns path made absolute with realpath. A path that does not exist yet,
+such as the output file, has its directory resolved instead. Falls back to
+path itself if neither can be resolved
+*/
+std::string absolutePath(const char *path) {
+
+    char resolved[PATH_MAX];
+    if (realpath(path, resolved) != nullptr) {
+        return resolved;
+    }
+
+    //dirname and basename may modify their argument, so each gets a copy
+    std::string directoryCopy = path;
+    std::string nameCopy = path;
+    if (realpath(dirname(&directoryCopy[0]), resolved) == nullptr) {
+        return path;
+    }
+    std::string directory = resolved;
+    return directory + (directory == "/" ? "" : "/") + basename(&nameCopy[0]);
+}
+
+bool sendAll(int server, const void *data, size_t size) {
+
+    size_t sent = 0;
+    while (sent < size) {
+        ssize_t written = write(server, (const char *)data + sent, size - sent);
+        if (written <= 0) {
+            return false;
+        }
+        sent += written;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+
+    if (argc < 3) {
+        printf("Wrong input\n");
+        exit(-1);
+    }
+
+    std::string request = argv[2];
+    std::vector<uint8_t> samples;
+
+    if (request == "RENDER" || request == "PCM") {
+        if (argc < 6) {
+            printf("Wrong input\n");
+            exit(-1);
+        }
+        if (request == "PCM") {
+            pcmLayout layout;
+            samples = readDataChunk(argv[3], &layout);
+            if (samples.empty()) {
+                return 1;
+            }
+            request += " " + to_string(samples.size() / layout.bytesPerFrame);
+            request += " " + absolutePath(argv[4]) + " " + absolutePath(argv[5]);
+            request += " " + to_string(layout.sampleRate) + " " + to_string(layout.channels) + " " + layout.format;
+        } else {
+            request += " " + absolutePath(argv[3]) + " " + absolutePath(argv[4]) + " " + absolutePath(argv[5]);
+        }
+    }
+    request += "\n";
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+
+    if (connect(server, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    if (!sendAll(server, request.data(), request.size()) ||
+        !sendAll(server, samples.data(), samples.size())) {
+        fprintf(stderr, "Lost connection to daemon\n");
+        return 1;
+    }
+
+    std::string response;
+    char c;
+    while (read(server, &c, 1) == 1 && c != '\n') {
+        response.push_back(c);
+    }
+    close(server);
+
+    printf("%s\n", response.c_str());
+    return response.compare(0, 2, "OK") == 0 ? 0 : 1;
+}
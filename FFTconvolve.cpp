@@ -6,6 +6,15 @@
 #include <fstream>
 #include "complex_functions.h"
 #include <iostream>
+#include <string.h>
+#include <chrono>
+#include "daemon.h"
+#include "resample.h"
+#include "partitioned.h"
+#include "shard.h"
+#include "incremental.h"
+#include "parallel.h"
+#include "stress.h"
 
 // CONSTANTS ******************************
 
@@ -36,6 +45,17 @@
 // Offset of the fmt chunk in the WAV header
 #define FMT_OFFSET			12
 
+// Format codes in the fmt chunk
+#define WAVE_FORMAT_PCM			1
+#define WAVE_FORMAT_IEEE_FLOAT	3
+#define WAVE_FORMAT_EXTENSIBLE	0xFFFE
+
+// Size of the ds64 chunk written to RF64 files, including its 8-byte header
+#define RF64_DS64_SIZE		36
+
+// Frames converted per block when reading or writing sample data
+#define IO_BLOCK_FRAMES		65536
+
 using namespace std;
 
 using cl = std::vector<std::pair<double, double>>;
@@ -43,6 +63,23 @@ char *outputFilename;
 double TWOPI = 6.28318530717958;
 int main(int argc, char **argv) {
 	
+    //Daemon mode: FFTconvolve --daemon socketPath [cacheMB] [workers]
+    if (argc >= 3 && strcmp(argv[1], "--daemon") == 0) {
+        size_t cacheMB = (argc > 3) ? atoi(argv[3]) : 256;
+        int workers = (argc > 4) ? atoi(argv[4]) : 2;
+        return runDaemon(argv[2], cacheMB * 1024 * 1024, workers);
+    }
+
+    //Worker for a sharded render: FFTconvolve --shard-worker input ir start count rawFile
+    if (argc >= 7 && strcmp(argv[1], "--shard-worker") == 0) {
+        return runShardWorker(argv[2], argv[3], atoll(argv[4]), atoll(argv[5]), argv[6]);
+    }
+
+    //Real-time stress test: FFTconvolve --rt-stress input ir blockSize [loadThreads]
+    if (argc >= 5 && strcmp(argv[1], "--rt-stress") == 0) {
+        int loadThreads = (argc > 5) ? atoi(argv[5]) : -1;
+        return runRealtimeStress(argv[2], argv[3], atoi(argv[4]), loadThreads);
+    }
 
 	if (argc < 4) {
 		printf("Wrong input\n");
@@ -57,66 +94,365 @@ int main(int argc, char **argv) {
 
 	outputFilename = argv[3];
 
-    FILE* inputFile = fopen(inputFilename, "r");
-    if (inputFile == nullptr)
-    {
-        fprintf(stderr, "Unable to open wav file: %s\n", inputFilename);
+    //Optional: -r rate resamples the output to the given sample rate,
+    //-f int16|int24|int32|float sets the output sample format,
+    //-b blockSize renders with the block engine instead of one whole-file FFT,
+    //-x irFile seconds switches the block engine to another IR at that time,
+    //-s shards splits the render across worker processes, which --hosts
+    //starts over ssh and --verify checks against a single-process render,
+    //-i seconds re-renders incrementally, reusing unchanged segments of that length,
+    //-t threads runs the whole-file FFT on that many threads, --pin pins them
+    //to CPUs spread over the NUMA nodes, --hugepages off|thp|explicit backs
+    //their buffers with huge pages
+    int outputRate = 0;
+    sampleFormat format;
+    sampleFormat *outputFormat = nullptr;
+    int blockSize = 0;
+    char *switchFilename = nullptr;
+    double switchSeconds = 0;
+    int shards = 0;
+    char *hosts = nullptr;
+    bool verify = false;
+    double segmentSeconds = 0;
+    parallelOptions parallel = {0, false, HUGE_PAGES_TRANSPARENT};
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            outputRate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc && parseSampleFormat(argv[i + 1], &format)) {
+            outputFormat = &format;
+            i++;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            blockSize = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-x") == 0 && i + 2 < argc) {
+            switchFilename = argv[++i];
+            switchSeconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            shards = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--hosts") == 0 && i + 1 < argc) {
+            hosts = argv[++i];
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            verify = true;
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            segmentSeconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            parallel.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pin") == 0) {
+            parallel.pin = true;
+        } else if (strcmp(argv[i], "--hugepages") == 0 && i + 1 < argc && parseHugePageMode(argv[i + 1], &parallel.hugePages)) {
+            i++;
+        } else {
+            printf("Wrong input\n");
+            exit(-1);
+        }
+    }
+
+    if (segmentSeconds > 0) {
+        return renderIncremental(inputFilename, irFilename, outputFilename, segmentSeconds, outputRate, outputFormat);
+    }
+    if (shards > 0) {
+        return renderSharded(argv[0], inputFilename, irFilename, outputFilename, shards, hosts, verify, outputRate, outputFormat);
+    }
+    if (blockSize > 0) {
+        return renderBlocks(inputFilename, irFilename, outputFilename, blockSize, switchFilename, switchSeconds, outputRate, outputFormat);
+    }
+    return renderFile(inputFilename, irFilename, outputFilename, outputRate, outputFormat,
+                      parallel.threads > 0 ? &parallel : nullptr);
+}
+
+/*
+Convolves the wav file inputFilename with the impulse response irFilename
+and writes the result to outputFilename. An IR recorded at a different
+sample rate is first resampled to the input's rate. If outputRate is not 0
+the result is resampled to it before writing. Each input channel is
+convolved with the matching IR channel, wrapping around if the IR has
+fewer. The output uses outputFormat, or the input's format if that is
+nullptr. If parallel is not nullptr the transforms are spread over its
+threads. Returns 0 on success, 1 if either input file could not be read
+*/
+int renderFile(char *inputFilename, char *irFilename, char *outputFilename, int outputRate, sampleFormat *outputFormat,
+               parallelOptions const *parallel) {
+
+    wavInfo input;
+    std::vector<std::vector<double>> inputChannels;
+    std::vector<std::vector<double>> irChannels;
+
+    //Read both input files, one vector per channel
+    printf("Reading wav file %s...\n", inputFilename);
+    if (!loadWavFile(inputFilename, &input, &inputChannels)) {
         return 1;
     }
 
-    FILE* irFile = fopen(irFilename, "r");
-    if (irFile == nullptr)
-    {
-        fprintf(stderr, "Unable to open IR file: %s\n", irFilename);
+    //Bring the IR to the input's sample rate so both are convolved on the same time grid
+    printf("Reading IR file %s...\n", irFilename);
+    if (!loadIRFile(irFilename, input.sampleRate, &irChannels)) {
         return 1;
     }
 
-	int inputChannels;
-    int inputSamples;
+    //Finding the file with the largest data size 
+    int maxSize = max(inputChannels[0].size(), irChannels[0].size());
+    std::vector<std::vector<double>> outputChannels;
+    if (parallel != nullptr) {
+        outputChannels = convolveChannelsParallel(inputChannels, irChannels, maxSize, *parallel);
+    } else {
+        outputChannels = convolveChannels(inputChannels, irChannels, maxSize);
+    }
+
+    writeOutput(outputChannels, input, outputRate, outputFormat, outputFilename);
+    
+    printf("Finished\n");
+    return 0;
+}
+
+/*
+Renders like renderFile, but streams the input through the partitioned
+block engine blockSize samples at a time. If switchFilename is given, that
+IR is staged at switchSeconds and the engine crossfades to it. The engine
+itself never waits for staging; this offline host does, so the switch
+lands at the requested time rather than whenever the load finishes
+*/
+int renderBlocks(char *inputFilename, char *irFilename, char *outputFilename, int blockSize,
+                 char *switchFilename, double switchSeconds, int outputRate, sampleFormat *outputFormat) {
 
-    int irChannels;
-    int irSamples;
+    wavInfo input;
+    std::vector<std::vector<double>> inputChannels;
+    std::vector<std::vector<double>> irChannels;
 
-    //Read the header data of both input files.
     printf("Reading wav file %s...\n", inputFilename);
-    readWavFileHeader(&inputChannels, &inputSamples, inputFile);
+    if (!loadWavFile(inputFilename, &input, &inputChannels)) {
+        return 1;
+    }
 
     printf("Reading IR file %s...\n", irFilename);
-    readWavFileHeader(&irChannels, &irSamples, irFile);
+    if (!loadIRFile(irFilename, input.sampleRate, &irChannels)) {
+        return 1;
+    }
 
-    //Read the wav data of each input file and copy it into vectors
-	std::vector<double> inputVector = readWavFile(&inputSamples, &inputChannels, inputFilename);
-    std::vector<double> irVector = readWavFile(&irSamples, &irChannels, irFilename);
+    //The FFT size is twice the block size and must be a power of 2
+    blockSize = nextPowerOfTwo(blockSize);
+    int irSize = irChannels[0].size();
+    int maxSize = max((int)inputChannels[0].size(), irSize);
+
+    //Leave room in the delay line for a switched-to IR up to twice as long as the first
+    int maxPartitions = 2 * ((irSize + blockSize - 1) / blockSize) + 1;
+
+    blockConvolver engine;
+    initBlockConvolver(&engine, blockSize, input.channels, input.sampleRate, maxPartitions, CROSSFADE_BLOCKS);
+    setIR(&engine, irChannels);
+
+    //Offline the deadline is not binding, but the report shows how close a live host would come
+    latencyHistogram *timing = new latencyHistogram;
+    initLatencyHistogram(timing, (int64_t)(blockSize * 1e9 / input.sampleRate));
+    engine.timing = timing;
+
+    std::vector<std::vector<double>> outputChannels(input.channels, std::vector<double>(maxSize));
+    std::vector<std::vector<double>> inputBlock(input.channels, std::vector<double>(blockSize));
+    std::vector<std::vector<double>> outputBlock(input.channels, std::vector<double>(blockSize));
+    std::vector<double *> inputPlanes(input.channels);
+    std::vector<double *> outputPlanes(input.channels);
+    for (int c = 0; c < input.channels; c++) {
+        inputPlanes[c] = inputBlock[c].data();
+        outputPlanes[c] = outputBlock[c].data();
+    }
 
-    //Converting the vectors of real numbers to vectors of complex numbers
-    cl complexInput = realToComplex(inputVector);
-    cl complexIR = realToComplex(irVector);
+    long long switchSample = switchFilename ? (long long)(switchSeconds * input.sampleRate) : -1;
+    for (int start = 0; start < maxSize; start += blockSize) {
+        if (switchSample >= 0 && start >= switchSample) {
+            printf("Switching to IR %s at %.2f s...\n", switchFilename, start / (double)input.sampleRate);
+            stageIRFile(&engine, switchFilename);
+            waitForStagedIR(&engine);
+            switchSample = -1;
+        }
 
-    //Finding the file with the largest data size 
-    int maxSize = max(complexInput.size(), complexIR.size());
-    int n = 1;
-    //With the largest data size now found, n will be the next closest power of 2
-    while(n < maxSize){
-        n*=2;
-    }
+        //Past the end of the input the engine keeps running on silence to finish the tail
+        int count = min(blockSize, maxSize - start);
+        for (int c = 0; c < input.channels; c++) {
+            int available = max(0, min(count, (int)inputChannels[c].size() - start));
+            std::fill(inputBlock[c].begin(), inputBlock[c].end(), 0.0);
+            std::copy(inputChannels[c].begin() + start, inputChannels[c].begin() + start + available, inputBlock[c].begin());
+        }
+
+        processBlock(&engine, inputPlanes.data(), outputPlanes.data());
 
-    complexInput.resize(n);
-    complexIR.resize(n);
+        for (int c = 0; c < input.channels; c++) {
+            std::copy(outputBlock[c].begin(), outputBlock[c].begin() + count, outputChannels[c].begin() + start);
+        }
 
-    //Begin convolution with the two input vectors
-    cl outputVector = convolveWithFFT(complexInput, complexIR);
-    double* outputArray = new double[maxSize];
+        //A live host would do this from a non-audio thread
+        collectRetiredIR(&engine);
+    }
+    destroyBlockConvolver(&engine);
+    printLatencyReport(timing, "Block timing");
+    delete timing;
 
-    //Copying the output vector's real numbers into the output array
-    for(int i = 0; i < maxSize;i++){
-        outputArray[i] = outputVector[i].first;
-    } 
+    writeOutput(outputChannels, input, outputRate, outputFormat, outputFilename);
 
-    //the output array will now be written to a new wav file
-    writeWavFile(outputArray, maxSize, inputChannels, outputFilename);
-    
     printf("Finished\n");
+    return 0;
+}
+
+/*
+Opens filename, reads its header and returns its samples one vector per
+channel. Prints why and returns false if the file cannot be used
+*/
+bool loadWavFile(char *filename, wavInfo *info, std::vector<std::vector<double>> *channels) {
+
+    FILE* inputFile = fopen(filename, "rb");
+    if (inputFile == nullptr)
+    {
+        fprintf(stderr, "Unable to open wav file: %s\n", filename);
+        return false;
+    }
+    if (!readWavFileHeader(info, inputFile)) {
+        fprintf(stderr, "Unsupported wav file: %s\n", filename);
+        return false;
+    }
+    *channels = readWavFile(*info, filename);
+    return true;
+}
 
+/*
+Loads an IR and brings it to sampleRate, one vector per channel
+*/
+bool loadIRFile(char *irFilename, int sampleRate, std::vector<std::vector<double>> *irChannels) {
+
+    wavInfo ir;
+    if (!loadWavFile(irFilename, &ir, irChannels)) {
+        return false;
+    }
+    if (ir.sampleRate != sampleRate) {
+        for (int c = 0; c < ir.channels; c++) {
+            (*irChannels)[c] = resampleWithReport((*irChannels)[c], ir.sampleRate, sampleRate, "IR");
+        }
+    }
+    return true;
+}
+
+/*
+Resamples the rendered channels to outputRate if it is set and differs
+from the input's rate, then writes them in outputFormat, or the input's
+format if that is nullptr
+*/
+void writeOutput(std::vector<std::vector<double>> &outputChannels, wavInfo const& input, int outputRate,
+                 sampleFormat *outputFormat, char *outputFilename) {
+
+    //the output will now be written to a new wav file
+    int rate = input.sampleRate;
+    if (outputRate != 0 && outputRate != input.sampleRate) {
+        for (size_t c = 0; c < outputChannels.size(); c++) {
+            outputChannels[c] = resampleWithReport(outputChannels[c], input.sampleRate, outputRate, "output");
+        }
+        rate = outputRate;
+    }
+    writeWavFile(outputChannels, rate, outputFormat ? *outputFormat : input.format, outputFilename);
+}
+
+/*
+Convolves every input channel with the matching IR channel (wrapping
+around if the IR has fewer) and returns the first outputSize samples of
+each. The transform is sized for the full linear convolution, so the tail
+never wraps around onto the start
+*/
+std::vector<std::vector<double>> convolveChannels(std::vector<std::vector<double>> const& inputChannels,
+                                                  std::vector<std::vector<double>> const& irChannels, int outputSize) {
+
+    int linearSize = inputChannels[0].size() + irChannels[0].size() - 1;
+    int n = nextPowerOfTwo(max(linearSize, 1));
+    fftPlan plan = makeFFTPlan(n);
+
+    //Each IR channel is transformed once and shared by every input channel that uses it
+    std::vector<cl> irSpectra;
+    for (size_t c = 0; c < irChannels.size(); c++) {
+        irSpectra.push_back(transformChannel(irChannels[c], plan));
+    }
+
+    std::vector<std::vector<double>> outputChannels(inputChannels.size());
+    for (size_t c = 0; c < inputChannels.size(); c++) {
+        outputChannels[c] = convolveChannel(inputChannels[c], irSpectra[c % irChannels.size()], plan, outputSize);
+    }
+    return outputChannels;
+}
+
+/*
+Zero-pads one channel to the plan's size and returns its spectrum.
+Samples past the plan's size are dropped
+*/
+cl transformChannel(std::vector<double> const& samples, fftPlan const& plan) {
+
+    cl spectrum = realToComplex(samples);
+    spectrum.resize(plan.n);
+    fft(spectrum.data(), plan, 1);
+    return spectrum;
+}
+
+/*
+Convolves one channel with an IR spectrum from transformChannel and
+returns the first outputSize samples of the result
+*/
+std::vector<double> convolveChannel(std::vector<double> const& samples, cl const& irSpectrum, fftPlan const& plan, int outputSize) {
+
+    cl spectrum = transformChannel(samples, plan);
+    for (int i = 0; i < plan.n; i++) {
+        spectrum[i] = multiply(spectrum[i], irSpectrum[i]);
+    }
+    fft(spectrum.data(), plan, -1);
+
+    //Copying the output's real numbers into the output channel
+    std::vector<double> output(outputSize);
+    for (int i = 0; i < outputSize && i < plan.n; i++) {
+        output[i] = spectrum[i].first;
+    }
+    return output;
+}
+
+/*
+Maps a name given on the command line (int16, int24, int32 or float)
+to a sample format. Returns false for anything else
+*/
+bool parseSampleFormat(const char *name, sampleFormat *format) {
+
+    if (strcmp(name, "int16") == 0) {
+        *format = PCM_INT16;
+    } else if (strcmp(name, "int24") == 0) {
+        *format = PCM_INT24;
+    } else if (strcmp(name, "int32") == 0) {
+        *format = PCM_INT32;
+    } else if (strcmp(name, "float") == 0) {
+        *format = PCM_FLOAT32;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*
+Resamples samples from inputRate to outputRate and reports how long it took.
+If the rate ratio is not supported the samples are returned unchanged
+*/
+std::vector<double> resampleWithReport(std::vector<double> const& samples, int inputRate, int outputRate, const char *what) {
+
+    polyphaseFilter filter;
+    if (!makePolyphaseFilter(inputRate, outputRate, &filter)) {
+        fprintf(stderr, "Cannot resample %s from %d Hz to %d Hz, using it unchanged\n", what, inputRate, outputRate);
+        return samples;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<double> resampled = resample(samples, filter);
+    double elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    printf("Resampled %s from %d Hz to %d Hz in %.1f ms\n", what, inputRate, outputRate, elapsedMs);
+    return resampled;
+}
+
+/*
+Returns the smallest power of 2 that is greater than or equal to size
+*/
+int nextPowerOfTwo(int size){
+    int n = 1;
+    while(n < size){
+        n*=2;
+    }
+    return n;
 }
 
 /*
@@ -159,178 +495,295 @@ std::pair<double, double> multiply(std::pair<double, double> const& a, std::pair
 
 
 /*
-Follows the basic stucture for convolution using FFT.
-First, the two input arrays will be converted to frequency-domain
-using FFT, then they will be multiplied entry-wise where the resulting
-data will be put into a new vector C. C will then be converted back
-to time-domain with inverse fft, and finally returned
+Precomputes everything about a size-n FFT that does not depend on the data:
+the bit-reversal permutation and the n/2 roots of unity. A plan can be reused
+for any number of transforms of that size, in either direction, from several
+threads at once since fft only reads it. n must be a power of 2
 */
-cl convolveWithFFT(cl const& a, cl const& b) {
+fftPlan makeFFTPlan(int n) {
 
-    cl A = a;
-    cl B = b;
+    fftPlan plan;
+    plan.n = n;
+    plan.bitReverse.resize(n);
+    plan.twiddles.resize(n / 2);
 
-    int n = A.size();
-    cl C(n);
+    int bits = 0;
+    while ((1 << bits) < n) {
+        bits++;
+    }
 
-    fft(A, 1);
-    fft(B, 1);
+    for (int i = 0; i < n; i++) {
+        int reversed = 0;
+        for (int b = 0; b < bits; b++) {
+            if (i & (1 << b)) {
+                reversed |= 1 << (bits - 1 - b);
+            }
+        }
+        plan.bitReverse[i] = reversed;
+    }
 
-    for(int i = 0; i < n;i++){
-        C[i] = multiply(A[i], B[i]);
+    //Computing every root directly rather than by repeated multiplication
+    //keeps the rounding error from growing with n
+    for (int k = 0; k < n / 2; k++) {
+        double theta = TWOPI * k / n;
+        plan.twiddles[k] = make_pair(cos(theta), sin(theta));
     }
 
-    fft(C, -1);
- 
-    return C;
+    return plan;
 }
 
 /*
-This function is the recursive FFT algorithm.
-It follows the steps of first splitting the input list
-into lists of odd and even indices. It then recurses on
-the even, then odd lists which have sizes of n/2. The base
-case of the recursion is a loop from 0 to n/2. Where the data
-from the even list is combined with the data from the odd list
-that has been multiplied by the n-th root of unity, which is
-where he variable omegan is from. Since e^(2(pi)ik/n) is equal
-to cos(2(pi)k/n) + i sin(2(pi)k/n)
-
-The source is from: https://cp-algorithms.com/algebra/fft.html
-but I replaced the use of C++ built-in complex class, because
-I wasn't sure if I was allowed to use it
+In-place iterative FFT using a precomputed plan. Direction 1 is forward,
+-1 is inverse and includes the 1/n scaling. It does not allocate, so it is
+safe to call on buffers that are reused from job to job
 */
-void fft(cl & A, int direction) {
-
-    int n = A.size();
-    if (n == 1)
-        return;
-
-    cl even(n / 2);
-    cl odd(n / 2);
+void fft(std::pair<double, double> *A, fftPlan const& plan, int direction) {
 
+    int n = plan.n;
 
-    for (int i = 0; i + i < n; i++) {
-        //Optimization 4: Strength Reduction
-        even[i] = A[i+i];
-        odd[i] = A[i+i+1];
+    for (int i = 0; i < n; i++) {
+        int j = plan.bitReverse[i];
+        if (i < j) {
+            std::swap(A[i], A[j]);
+        }
     }
-    
-    fft(even, direction);
-    fft(odd, direction);
-
-    std::pair<double, double> omega(1, 0);
-
-    //Optimization 3: Precompute using constant TWOPI
-    double theta = TWOPI / n * direction;
-    //Optimization 2: Minimize Work
-    std::pair<double, double> omegan(cos(theta), sin(theta));
-    for (int i = 0; 2 * i < n; i++) {
-
-        std::pair<double, double> temp = multiply(omega, odd[i]);
 
-        A[i].first = even[i].first + temp.first;
-        A[i].second = even[i].second + temp.second;
-
-        A[i + n/2].first = even[i].first - temp.first;
-        A[i + n/2].second = even[i].second - temp.second;
+    for (int len = 2; len <= n; len += len) {
+        int half = len / 2;
+        int step = n / len;
+        for (int i = 0; i < n; i += len) {
+            for (int k = 0; k < half; k++) {
+                std::pair<double, double> w = plan.twiddles[k * step];
+                w.second *= direction;
+
+                std::pair<double, double> u = A[i + k];
+                std::pair<double, double> v = multiply(w, A[i + k + half]);
+
+                A[i + k].first = u.first + v.first;
+                A[i + k].second = u.second + v.second;
+                A[i + k + half].first = u.first - v.first;
+                A[i + k + half].second = u.second - v.second;
+            }
+        }
+    }
 
-        if (direction == -1) {
-            A[i].first /= 2;
-            A[i].second /= 2;
-            A[i + n/2].first /= 2;
-            A[i + n/2].second /= 2;
+    if (direction == -1) {
+        double scale = 1.0 / n;
+        for (int i = 0; i < n; i++) {
+            A[i].first *= scale;
+            A[i].second *= scale;
         }
-        omega = multiply(omega, omegan);
     }
 }
 
 /*
-This function takes an input wav file and reads data from its header
+This function takes an input wav file and reads data from its header.
+It walks the chunks rather than assuming a fixed 44-byte layout, so fmt
+chunks with extra bytes, WAVE_FORMAT_EXTENSIBLE and RF64 files (whose
+sizes live in the ds64 chunk) are all accepted. Returns false if the file
+is not a wav file or uses a sample format that cannot be decoded
 */
-void readWavFileHeader(int *channels, int *numSamples, FILE *inputFile){
+bool readWavFileHeader(wavInfo *info, FILE *inputFile){
+
+    char id[4];
+    bool rf64 = false;
+    bool haveFormat = false;
+    bool haveData = false;
+    long long ds64DataSize = -1;
+    int formatCode = 0;
+    int bits = 0;
+
+    if (fread(id, 1, 4, inputFile) != 4) {
+        fclose(inputFile);
+        return false;
+    }
+    if (memcmp(id, "RF64", 4) == 0) {
+        rf64 = true;
+    } else if (memcmp(id, "RIFF", 4) != 0) {
+        fclose(inputFile);
+        return false;
+    }
+    freadIntLSB(inputFile);
+    if (fread(id, 1, 4, inputFile) != 4 || memcmp(id, "WAVE", 4) != 0) {
+        fclose(inputFile);
+        return false;
+    }
 
-    myHeader wavHeader;
-    int headerSize = sizeof(myHeader);
+    while (!haveData && fread(id, 1, 4, inputFile) == 4) {
+        unsigned int chunkSize = (unsigned int)freadIntLSB(inputFile);
+        long long chunkStart = ftello(inputFile);
+
+        if (memcmp(id, "ds64", 4) == 0) {
+            /*  RIFF size, then data size  */
+            freadLongLSB(inputFile);
+            ds64DataSize = freadLongLSB(inputFile);
+        } else if (memcmp(id, "fmt ", 4) == 0) {
+            formatCode = (uint16_t)freadShortLSB(inputFile);
+            info->channels = freadShortLSB(inputFile);
+            info->sampleRate = freadIntLSB(inputFile);
+            /*  Bytes per second and block alignment are implied by the rest  */
+            freadIntLSB(inputFile);
+            freadShortLSB(inputFile);
+            bits = freadShortLSB(inputFile);
+
+            //The real format code is the first two bytes of the SubFormat GUID
+            if (formatCode == WAVE_FORMAT_EXTENSIBLE && chunkSize >= 40) {
+                freadShortLSB(inputFile);
+                freadShortLSB(inputFile);
+                freadIntLSB(inputFile);
+                formatCode = (uint16_t)freadShortLSB(inputFile);
+            }
+            haveFormat = true;
+        } else if (memcmp(id, "data", 4) == 0) {
+            long long dataSize = chunkSize;
+            if (rf64 && chunkSize == 0xFFFFFFFF && ds64DataSize >= 0) {
+                dataSize = ds64DataSize;
+            }
+
+            //A writer that was interrupted may leave a size larger than the file
+            fseeko(inputFile, 0, SEEK_END);
+            long long remaining = ftello(inputFile) - chunkStart;
+            if (dataSize > remaining) {
+                dataSize = remaining;
+            }
+            info->dataOffset = chunkStart;
+            info->frames = dataSize;
+            haveData = true;
+        }
 
-    size_t bytesRead = fread(&wavHeader, 1, headerSize, inputFile);
-    if (bytesRead > 0)
-    {
-        int numberSamples = (int) (wavHeader.ChunkSize / ( wavHeader.BitsPerSample / 8));
-        int duration = numberSamples/ wavHeader.SampleRate;
-        numberSamples = duration * wavHeader.SampleRate;
-        *numSamples = numberSamples;
+        /*  Chunks are padded to an even number of bytes  */
+        fseeko(inputFile, chunkStart + chunkSize + (chunkSize & 1), SEEK_SET);
     }
-
     fclose(inputFile);
-    return;
+
+    if (!haveFormat || !haveData || info->channels < 1 || info->sampleRate < 1) {
+        return false;
+    }
+
+    if (formatCode == WAVE_FORMAT_PCM && bits == 16) {
+        info->format = PCM_INT16;
+    } else if (formatCode == WAVE_FORMAT_PCM && bits == 24) {
+        info->format = PCM_INT24;
+    } else if (formatCode == WAVE_FORMAT_PCM && bits == 32) {
+        info->format = PCM_INT32;
+    } else if (formatCode == WAVE_FORMAT_IEEE_FLOAT && bits == 32) {
+        info->format = PCM_FLOAT32;
+    } else {
+        return false;
+    }
+
+    info->frames /= (long long)bytesPerSample(info->format) * info->channels;
+    return true;
 }
 
 /*
-This function takes the wav data from a wav file and copies it into the output vector
+This function takes the wav data from a wav file and returns it as one
+vector per channel, with samples scaled to the range [-1, 1)
 */
-std::vector<double> readWavFile(int *arraySize, int *channels, char *filename){
-    
-    int numChannels = *channels;
-    int size = *arraySize;
-    std::vector<double> outputArray;
-    int16_t *buffer = new int16_t[size];
+std::vector<std::vector<double>> readWavFile(wavInfo const& info, char *filename){
+
+    return readWavFrames(info, filename, 0, info.frames);
+}
 
-    FILE* inp = fopen(filename, "r");
+/*
+Like readWavFile, but returns only count frames starting at frame start,
+so a worker can load its own segment of a long file
+*/
+std::vector<std::vector<double>> readWavFrames(wavInfo const& info, char *filename, long long start, long long count){
 
-    fread(buffer, 2, size, inp);
+    count = max(0LL, min(count, info.frames - start));
+    std::vector<std::vector<double>> outputArray(info.channels, std::vector<double>(count));
 
-    for (int i = 0; i < size; i++) {
-        outputArray.push_back(buffer[i]);
+    FILE* inp = fopen(filename, "rb");
+    if (inp == nullptr) {
+        return outputArray;
     }
 
-    delete buffer;
+    //Converting a block at a time keeps the raw copy small however long the file is
+    size_t frameSize = (size_t)bytesPerSample(info.format) * info.channels;
+    std::vector<uint8_t> buffer(IO_BLOCK_FRAMES * frameSize);
+    std::vector<double *> planes(info.channels);
+    fseeko(inp, info.dataOffset + start * (long long)frameSize, SEEK_SET);
+
+    long long done = 0;
+    while (done < count) {
+        size_t want = (size_t)min((long long)IO_BLOCK_FRAMES, count - done);
+        size_t got = fread(buffer.data(), frameSize, want, inp);
+        for (int c = 0; c < info.channels; c++) {
+            planes[c] = outputArray[c].data() + done;
+        }
+        decodeSamples(buffer.data(), info.format, got, info.channels, planes.data());
+        done += got;
+        if (got < want) {
+            break;
+        }
+    }
+    fclose(inp);
 
     return outputArray;
 }
 
 /*
 Writes the header for a WAV file with the given attributes to 
- the provided filestream
+ the provided filestream. 16-bit mono and stereo get the plain 16-byte fmt
+ chunk; everything else uses WAVE_FORMAT_EXTENSIBLE. Files whose data
+ would not fit in a 32-bit RIFF size are written as RF64
 */
 
-void writeWavFileHeader(int channels, int numberSamples, double outputRate, FILE *outputFile) {
-    // Note: channels is not currently used. You will need to add this functionality
-	// yourself for the bonus part of the assignment
+void writeWavFileHeader(int channels, long long numberFrames, double outputRate, sampleFormat format, FILE *outputFile) {
 	
+    int bytes = bytesPerSample(format);
+    bool extensible = channels > STEREOPHONIC || format != PCM_INT16;
+    int fmtSize = extensible ? 40 : 16;
+    int formatCode = (format == PCM_FLOAT32) ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+
 	/*  Calculate the total number of bytes for the data chunk  */
-    int dataChunkSize = numberSamples * BYTES_PER_SAMPLE;
+    long long dataChunkSize = numberFrames * channels * bytes;
 	
     /*  Calculate the total number of bytes for the form size  */
-    int formSize = 36 + dataChunkSize;
+    long long formSize = 4 + (8 + fmtSize) + (8 + dataChunkSize + (dataChunkSize & 1));
+    bool rf64 = formSize + RF64_DS64_SIZE > 0xFFFFFFFFLL;
+    if (rf64) {
+        formSize += RF64_DS64_SIZE;
+    }
 	
     /*  Calculate the total number of bytes per frame  */
-    short int frameSize = channels * BYTES_PER_SAMPLE;
+    short int frameSize = channels * bytes;
 	
     /*  Calculate the byte rate  */
     int bytesPerSecond = (int)ceil(outputRate * frameSize);
 
     /*  Write header to file  */
     /*  Form container identifier  */
-    fputs("RIFF", outputFile);
+    fputs(rf64 ? "RF64" : "RIFF", outputFile);
       
-    /*  Form size  */
-    fwriteIntLSB(formSize, outputFile);
+    /*  Form size (RF64 keeps the real value in ds64)  */
+    fwriteIntLSB(rf64 ? (int)0xFFFFFFFF : (int)formSize, outputFile);
       
     /*  Form container type  */
     fputs("WAVE", outputFile);
 
+    if (rf64) {
+        /*  ds64 chunk: form size, data size, sample count, empty table  */
+        fputs("ds64", outputFile);
+        fwriteIntLSB(RF64_DS64_SIZE - 8, outputFile);
+        fwriteLongLSB(formSize, outputFile);
+        fwriteLongLSB(dataChunkSize, outputFile);
+        fwriteLongLSB(numberFrames, outputFile);
+        fwriteIntLSB(0, outputFile);
+    }
+
     /*  Format chunk identifier (Note: space after 't' needed)  */
     fputs("fmt ", outputFile);
       
-    /*  Format chunk size (fixed at 16 bytes)  */
-    fwriteIntLSB(16, outputFile);
+    /*  Format chunk size  */
+    fwriteIntLSB(fmtSize, outputFile);
 
-    /*  Compression code:  1 = PCM  */
-    fwriteShortLSB(1, outputFile);
+    /*  Compression code  */
+    fwriteShortLSB(extensible ? (short)WAVE_FORMAT_EXTENSIBLE : formatCode, outputFile);
 
     /*  Number of channels  */
-    fwriteShortLSB((short) MONOPHONIC, outputFile);
+    fwriteShortLSB((short) channels, outputFile);
 
     /*  Output Sample Rate  */
     fwriteIntLSB((int)outputRate, outputFile);
@@ -342,24 +795,36 @@ void writeWavFileHeader(int channels, int numberSamples, double outputRate, FILE
     fwriteShortLSB(frameSize, outputFile);
 
     /*  Bits per sample  */
-    fwriteShortLSB(BITS_PER_SAMPLE, outputFile);
+    fwriteShortLSB(bytes * 8, outputFile);
+
+    if (extensible) {
+        /*  Extension size, valid bits, speaker mask  */
+        fwriteShortLSB(22, outputFile);
+        fwriteShortLSB(bytes * 8, outputFile);
+        fwriteIntLSB(channels == MONOPHONIC ? 0x4 : (channels < 32 ? (1 << channels) - 1 : 0), outputFile);
+
+        /*  SubFormat GUID: the format code followed by the fixed KSDATAFORMAT suffix  */
+        static const unsigned char guidSuffix[14] = {
+            0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+        };
+        fwriteShortLSB(formatCode, outputFile);
+        fwrite(guidSuffix, 1, sizeof(guidSuffix), outputFile);
+    }
 
     /*  Sound Data chunk identifier  */
     fputs("data", outputFile);
 
     /*  Chunk size  */
-    fwriteIntLSB(dataChunkSize, outputFile);
+    fwriteIntLSB(rf64 ? (int)0xFFFFFFFF : (int)dataChunkSize, outputFile);
 }
 
 
 /*
-Creates a WAV file with the contents of the provided outputArray as the samples, and writes
+Creates a WAV file with the contents of the provided channels as the samples, and writes
 it to the given filename
  */
 
-void writeWavFile(double *outputArray, int outputArraySize, int channels, char *filename) {
-    // Note: channels is not currently used. You will need to add this functionality
-	// yourself for the bonus part of the assignment
+void writeWavFile(std::vector<std::vector<double>> const& channels, double outputRate, sampleFormat format, char *filename) {
 
   //open a binary output file stream for writing
     FILE *outputFileStream = fopen(filename, "wb");
@@ -368,30 +833,67 @@ void writeWavFile(double *outputArray, int outputArraySize, int channels, char *
         return;
     }
 
-    //create an 16-bit integer array to hold rescaled samples
-    short *intArray = new short[outputArraySize];
+    int numChannels = channels.size();
+    long long numFrames = channels.empty() ? 0 : channels[0].size();
 
     //find the largest entry and uses that to rescale all other
-    // doubles to be in the range (-1, 1) to prevent 16-bit integer overflow
+    // doubles to be in the range (-1, 1) to prevent integer overflow
     double largestDouble = 1;
-    for (int i=0; i< outputArraySize; i++) {
-		if (abs(outputArray[i]) > largestDouble) {
-			largestDouble = abs(outputArray[i]);
-		}
+    for (int c = 0; c < numChannels; c++) {
+        for (long long i = 0; i < numFrames; i++) {
+            if (abs(channels[c][i]) > largestDouble) {
+                largestDouble = abs(channels[c][i]);
+            }
+        }
     }
 
-    for (int i=0; i<outputArraySize; i++) {
-		intArray[i] = (short) ((outputArray[i]/largestDouble)*MAX_SHORT_VALUE);
+	// actual file writing
+    writeWavFileHeader(numChannels, numFrames, outputRate, format, outputFileStream);
+
+    //Samples are encoded a block at a time into a reused buffer
+    size_t frameSize = (size_t)bytesPerSample(format) * numChannels;
+    std::vector<uint8_t> buffer(IO_BLOCK_FRAMES * frameSize);
+    std::vector<double *> planes(numChannels);
+
+    for (long long done = 0; done < numFrames; done += IO_BLOCK_FRAMES) {
+        size_t count = (size_t)min((long long)IO_BLOCK_FRAMES, numFrames - done);
+        for (int c = 0; c < numChannels; c++) {
+            planes[c] = const_cast<double *>(channels[c].data()) + done;
+        }
+        encodeSamples(planes.data(), numChannels, count, 1.0 / largestDouble, format, buffer.data());
+        fwrite(buffer.data(), frameSize, count, outputFileStream);
     }
-	
-    int numSamples = outputArraySize;
 
-	// actual file writing
-    writeWavFileHeader(channels, numSamples, SAMPLE_RATE, outputFileStream);
-    fwrite(intArray, sizeof(short), outputArraySize, outputFileStream);
-    
-    //clear memory from heap
-    delete[] intArray;
+    /*  Pad the data chunk to an even length  */
+    if ((numFrames * frameSize) & 1) {
+        fputc(0, outputFileStream);
+    }
+    fclose(outputFileStream);
+}
+
+
+//writes a 64-bit integer to the provided stream in little-endian form
+size_t fwriteLongLSB(long long data, FILE *stream) {
+    unsigned char array[8];
+
+    for (int i = 0; i < 8; i++) {
+        array[i] = (unsigned char)((data >> (8 * i)) & 0xFF);
+    }
+    return fwrite(array, sizeof(unsigned char), 8, stream);
+}
+
+
+//reads a 64-bit integer from the provided stream in little-endian form
+long long freadLongLSB(FILE *stream) {
+    unsigned char array[8];
+
+    fread(array, sizeof(unsigned char), 8, stream);
+
+    long long data = 0;
+    for (int i = 7; i >= 0; i--) {
+        data = (data << 8) | array[i];
+    }
+    return data;
 }
 
 
@@ -0,0 +1,207 @@
+/*
+	Allocation and placement for large render buffers
+
+	allocateBuffer maps memory without touching it, so each page is placed
+	on the NUMA node of the thread that first writes it. Callers that split
+	a buffer between pinned worker threads should have each worker
+	initialise its own region. releasePages does the same for memory that
+	has already been touched elsewhere, such as a zero-filled vector.
+	Buffers can be backed by explicit huge pages
+	(MAP_HUGETLB, which needs pages reserved in /proc/sys/vm/nr_hugepages) or
+	transparent huge pages (madvise). Explicit falls back to transparent, and
+	transparent to normal pages, when the kernel refuses.
+
+	numaNodeCpus reads the topology from sysfs, and a machine without NUMA
+	looks like a single node holding every CPU this process may run on
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <string>
+#include <vector>
+#include "buffers.h"
+
+// Size of an explicit huge page; allocations are rounded up to a multiple of it
+#define HUGE_PAGE_SIZE		(2 * 1024 * 1024)
+
+// Highest NUMA node number probed in sysfs
+#define MAX_NUMA_NODES		64
+
+using namespace std;
+
+static size_t roundToHugePage(size_t bytes) {
+
+    return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+/*
+Maps at least bytes of untouched memory. used is set to the kind of
+pages actually obtained. Returns nullptr only if no memory could be mapped
+*/
+void *allocateBuffer(size_t bytes, hugePageMode mode, hugePageMode *used) {
+
+    size_t size = roundToHugePage(bytes);
+    void *buffer = MAP_FAILED;
+
+    if (mode == HUGE_PAGES_EXPLICIT) {
+        buffer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (buffer != MAP_FAILED) {
+            *used = HUGE_PAGES_EXPLICIT;
+            return buffer;
+        }
+        mode = HUGE_PAGES_TRANSPARENT;
+    }
+
+    buffer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        return nullptr;
+    }
+
+    *used = HUGE_PAGES_OFF;
+#ifdef MADV_HUGEPAGE
+    if (mode == HUGE_PAGES_TRANSPARENT && madvise(buffer, size, MADV_HUGEPAGE) == 0) {
+        *used = HUGE_PAGES_TRANSPARENT;
+    }
+#endif
+    return buffer;
+}
+
+void freeBuffer(void *buffer, size_t bytes) {
+
+    if (buffer != nullptr) {
+        munmap(buffer, roundToHugePage(bytes));
+    }
+}
+
+/*
+Hands the whole pages inside [buffer, buffer + bytes) back to the kernel.
+They read as zeros afterwards and are placed on the node of whichever
+thread writes them next. The partial pages at either end are left alone
+*/
+void releasePages(void *buffer, size_t bytes) {
+
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)buffer + page - 1) / page * page;
+    uintptr_t end = ((uintptr_t)buffer + bytes) / page * page;
+    if (end > start) {
+        madvise((void *)start, end - start, MADV_DONTNEED);
+    }
+}
+
+//parses a sysfs cpulist such as "0-3,8,10-11"
+static std::vector<int> parseCpuList(const char *text) {
+
+    std::vector<int> cpus;
+    const char *p = text;
+    while (*p != '\0' && *p != '\n') {
+        int first;
+        int last;
+        int used;
+        if (sscanf(p, "%d-%d%n", &first, &last, &used) == 2) {
+            p += used;
+        } else if (sscanf(p, "%d%n", &first, &used) == 1) {
+            last = first;
+            p += used;
+        } else {
+            break;
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return cpus;
+}
+
+/*
+Returns the CPUs this process may run on, grouped by NUMA node. Nodes with
+no usable CPUs are left out
+*/
+std::vector<std::vector<int>> numaNodeCpus() {
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    std::vector<std::vector<int>> nodes;
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        std::string path = "/sys/devices/system/node/node" + to_string(node) + "/cpulist";
+        FILE *cpulist = fopen(path.c_str(), "r");
+        if (cpulist == nullptr) {
+            continue;
+        }
+        char text[4096];
+        std::vector<int> cpus;
+        if (fgets(text, sizeof(text), cpulist) != nullptr) {
+            for (int cpu : parseCpuList(text)) {
+                if (!haveMask || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))) {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+        fclose(cpulist);
+        if (!cpus.empty()) {
+            nodes.push_back(cpus);
+        }
+    }
+
+    //No NUMA information: one node with every allowed CPU
+    if (nodes.empty()) {
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (haveMask ? CPU_ISSET(cpu, &allowed) : cpu == 0) {
+                cpus.push_back(cpu);
+            }
+        }
+        nodes.push_back(cpus);
+    }
+    return nodes;
+}
+
+/*
+Restricts the calling thread to one CPU. Returns false, leaving the
+thread unpinned, if the kernel refuses
+*/
+bool pinThread(int cpu) {
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return false;
+    }
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0;
+}
+
+const char *hugePageModeName(hugePageMode mode) {
+
+    switch (mode) {
+    case HUGE_PAGES_EXPLICIT:
+        return "explicit huge";
+    case HUGE_PAGES_TRANSPARENT:
+        return "transparent huge";
+    default:
+        return "normal";
+    }
+}
+
+bool parseHugePageMode(const char *name, hugePageMode *mode) {
+
+    if (strcmp(name, "off") == 0) {
+        *mode = HUGE_PAGES_OFF;
+    } else if (strcmp(name, "thp") == 0) {
+        *mode = HUGE_PAGES_TRANSPARENT;
+    } else if (strcmp(name, "explicit") == 0) {
+        *mode = HUGE_PAGES_EXPLICIT;
+    } else {
+        return false;
+    }
+    return true;
+}
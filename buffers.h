@@ -0,0 +1,23 @@
+#ifndef BUFFERS_H
+#define BUFFERS_H
+
+#include <stddef.h>
+#include <vector>
+
+//how large buffers should be backed
+enum hugePageMode
+{
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_TRANSPARENT,
+    HUGE_PAGES_EXPLICIT
+};
+
+void *allocateBuffer(size_t bytes, hugePageMode mode, hugePageMode *used);
+void freeBuffer(void *buffer, size_t bytes);
+void releasePages(void *buffer, size_t bytes);
+std::vector<std::vector<int>> numaNodeCpus();
+bool pinThread(int cpu);
+const char *hugePageModeName(hugePageMode mode);
+bool parseHugePageMode(const char *name, hugePageMode *mode);
+
+#endif
@@ -2,45 +2,67 @@
 #define FUNCTIONS_H
 
 #include <vector>
+#include "pcm.h"
 
 int getFileSize(FILE* inFile);
 
-typedef struct HEADER
+//layout of a wav file's sample data, filled in by readWavFileHeader
+struct wavInfo
 {
-    uint8_t         ChunkID[4];
-    uint32_t        ChunkSize;
-    uint8_t         Format[4];
-    uint8_t         Subchunk1ID[4];
-    uint32_t        Subchunk1Size;
-    uint16_t        AudioFormat;
-    uint16_t        NumChannels;
-    uint32_t        SampleRate;
-    uint32_t        ByteRate;
-    uint16_t        BlockAlign;
-    uint16_t        BitsPerSample;
-    uint8_t         Subchunk2ID[4];
-    uint32_t        Subchunk2Size;
-} myHeader;
+    int             channels;
+    int             sampleRate;
+    sampleFormat    format;
+    long long       frames;
+    long long       dataOffset;
+};
 
 //complex list
 using cl = std::vector<std::pair<double, double>>;
 
+//precomputed tables for a power-of-2 FFT of size n
+struct fftPlan
+{
+    int                 n;
+    std::vector<int>    bitReverse;
+    cl                  twiddles;
+};
+
+struct parallelOptions;
+int renderFile(char *inputFilename, char *irFilename, char *outputFilename, int outputRate, sampleFormat *outputFormat,
+               parallelOptions const *parallel);
+std::vector<std::vector<double>> convolveChannels(std::vector<std::vector<double>> const& inputChannels,
+                                                  std::vector<std::vector<double>> const& irChannels, int outputSize);
+cl transformChannel(std::vector<double> const& samples, fftPlan const& plan);
+std::vector<double> convolveChannel(std::vector<double> const& samples, cl const& irSpectrum, fftPlan const& plan, int outputSize);
+bool parseSampleFormat(const char *name, sampleFormat *format);
+int renderBlocks(char *inputFilename, char *irFilename, char *outputFilename, int blockSize,
+                 char *switchFilename, double switchSeconds, int outputRate, sampleFormat *outputFormat);
+bool loadWavFile(char *filename, wavInfo *info, std::vector<std::vector<double>> *channels);
+bool loadIRFile(char *irFilename, int sampleRate, std::vector<std::vector<double>> *irChannels);
+void writeOutput(std::vector<std::vector<double>> &outputChannels, wavInfo const& input, int outputRate,
+                 sampleFormat *outputFormat, char *outputFilename);
+std::vector<double> resampleWithReport(std::vector<double> const& samples, int inputRate, int outputRate, const char *what);
+int nextPowerOfTwo(int size);
+
 cl realToComplex(std::vector<double> const& a);
 std::pair<double, double> multiply(std::pair<double, double> const& a, std::pair<double, double> const& b);
-cl convolveWithFFT(cl const& a, cl const& b);
-void fft(cl & A, int direction);
+fftPlan makeFFTPlan(int n);
+void fft(std::pair<double, double> *A, fftPlan const& plan, int direction);
 
 void convolve(double* INPUT, double* IR, int inpSize, int irSize, int channels);
 
-std::vector<double> readWavFile(int *arraySize, int *channels, char *filename);	
-void readWavFileHeader(int *channels, int *numSamples, FILE *inputFile);
+std::vector<std::vector<double>> readWavFile(wavInfo const& info, char *filename);
+std::vector<std::vector<double>> readWavFrames(wavInfo const& info, char *filename, long long start, long long count);
+bool readWavFileHeader(wavInfo *info, FILE *inputFile);
 
-void writeWavFile(double *outputArray, int outputArraySize, int channels, char *filename);
-void writeWavFileHeader(int channels, int numberSamples, double outputRate, FILE *outputFile);
+void writeWavFile(std::vector<std::vector<double>> const& channels, double outputRate, sampleFormat format, char *filename);
+void writeWavFileHeader(int channels, long long numberFrames, double outputRate, sampleFormat format, FILE *outputFile);
 
 size_t fwriteIntLSB(int data, FILE *stream);
 int freadIntLSB(FILE *stream);
 size_t fwriteShortLSB(short int data, FILE *stream);
 short int freadShortLSB(FILE *stream);
+size_t fwriteLongLSB(long long data, FILE *stream);
+long long freadLongLSB(FILE *stream);
 
 #endif
\ No newline at end of file
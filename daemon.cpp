@@ -0,0 +1,705 @@
+/*
+	Long-running render daemon for FFTconvolve
+
+	Usage: ./FFTconvolve --daemon socketPath [cacheMB] [workers]
+
+	Listens on a Unix domain socket and renders convolution jobs on a pool of
+	worker threads. FFT plans and transformed IR spectra stay resident between
+	jobs in an LRU cache bounded by cacheMB, so repeated renders against the
+	same IR skip the IR load and transform entirely. IRs are loaded with
+	loadIRFile, so one recorded at another rate than the input is resampled
+	(or reported as unsupported) exactly as in the command-line renderer.
+	The loaded IR is cached too, and the transform is sized from its actual
+	length, so the cached spectrum already includes the conversion.
+
+	Each request is a single text line, answered with a single line that
+	starts with OK or ERR:
+
+	    RENDER <input.wav> <ir.wav> <output.wav>
+	    PCM <frames> <ir.wav> <output.wav> [sampleRate [channels [format]]]
+	        (followed by frames of interleaved little-endian samples in
+	        format int16, int24, int32 or float; 44100 Hz mono int16
+	        unless stated. The output is written in the same format)
+	    STATS
+	    SHUTDOWN
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include "complex_functions.h"
+#include "daemon.h"
+
+using namespace std;
+
+// Number of recent job latencies kept for the percentile in STATS
+#define LATENCY_WINDOW		256
+
+// Sample rate assumed for inline PCM that does not state one
+#define DEFAULT_PCM_RATE	44100
+
+// Largest inline PCM payload accepted, in samples over all channels: 25 minutes of 44.1 kHz
+// mono, whose transform alone takes 2 GB
+#define PCM_MAX_SAMPLES		(1 << 26)
+
+// Seconds a client has to send its whole request, payload included, before it is dropped
+#define CLIENT_TIMEOUT		10
+
+// Connections whose request is still being read at once; further clients are turned away
+#define MAX_PENDING_CLIENTS	64
+
+// Longest request line accepted, enough for three 4095-byte paths
+#define REQUEST_MAX_LINE	16384
+
+// Pause after accept fails for lack of descriptors or memory, in milliseconds
+#define ACCEPT_BACKOFF_MS	100
+
+typedef std::chrono::steady_clock clk;
+
+struct renderJob
+{
+    std::string             input;
+    std::string             ir;
+    std::string             output;
+    long                    pcmFrames;
+    int                     pcmRate;
+    int                     pcmChannels;
+    sampleFormat            pcmFormat;
+    std::vector<uint8_t>    pcmData;
+    bool                    inlinePCM;
+    int                     client;
+    clk::time_point         queued;
+};
+
+/*
+A cached item is an FFT plan, an IR loaded at some rate, or that IR
+transformed at some size. All are held
+through shared_ptr so that evicting an entry never frees data that a
+worker is still using
+*/
+struct cacheEntry
+{
+    std::shared_ptr<fftPlan>    plan;
+    std::shared_ptr<std::vector<std::vector<double>>> samples;
+    std::shared_ptr<std::vector<cl>> spectrum;
+    size_t                      bytes;
+    std::list<std::string>::iterator position;
+};
+
+// Job queue
+static std::mutex queueLock;
+static std::condition_variable queueReady;
+static std::deque<renderJob> jobQueue;
+static bool shuttingDown = false;
+
+// Connections still sending their request, and the pipe that wakes the accept loop on SHUTDOWN
+static std::mutex pendingLock;
+static std::condition_variable pendingDone;
+static int pendingClients = 0;
+static int wakePipe[2] = {-1, -1};
+
+// LRU cache of plans and IR spectra, most recently used at the front
+static std::mutex cacheLock;
+static std::list<std::string> cacheOrder;
+static std::unordered_map<std::string, cacheEntry> cacheEntries;
+static size_t cacheBytes = 0;
+static size_t cacheBudget = 0;
+
+// Statistics, guarded by statsLock
+static std::mutex statsLock;
+static int activeJobs = 0;
+static long completedJobs = 0;
+static long failedJobs = 0;
+static long droppedClients = 0;
+static long cacheHits = 0;
+static long cacheMisses = 0;
+static double totalLatencyMs = 0;
+static double maxLatencyMs = 0;
+static double recentLatencyMs[LATENCY_WINDOW];
+
+
+/*
+Looks up key in the cache and moves it to the front. Returns nullptr
+on a miss. Must be called with cacheLock held
+*/
+static cacheEntry *cacheFind(std::string const& key) {
+
+    auto found = cacheEntries.find(key);
+    if (found == cacheEntries.end()) {
+        return nullptr;
+    }
+    cacheOrder.splice(cacheOrder.begin(), cacheOrder, found->second.position);
+    return &found->second;
+}
+
+/*
+Inserts an entry at the front of the cache, then evicts from the back
+until the cache is within budget. The entry just inserted is never evicted,
+so an item larger than the whole budget is still usable for this job.
+Must be called with cacheLock held
+*/
+static void cacheInsert(std::string const& key, cacheEntry entry) {
+
+    if (cacheEntries.count(key)) {
+        return;
+    }
+    cacheOrder.push_front(key);
+    entry.position = cacheOrder.begin();
+    cacheBytes += entry.bytes;
+    cacheEntries[key] = entry;
+
+    while (cacheBytes > cacheBudget && cacheOrder.size() > 1) {
+        std::string victim = cacheOrder.back();
+        cacheOrder.pop_back();
+        cacheBytes -= cacheEntries[victim].bytes;
+        cacheEntries.erase(victim);
+    }
+}
+
+/*
+Returns the FFT plan for size n, building it on a miss
+*/
+static std::shared_ptr<fftPlan> getPlan(int n) {
+
+    std::string key = "plan:" + to_string(n);
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        cacheEntry *entry = cacheFind(key);
+        if (entry != nullptr) {
+            return entry->plan;
+        }
+    }
+
+    //Built outside the lock so other workers are not held up by it
+    cacheEntry entry;
+    entry.plan = std::make_shared<fftPlan>(makeFFTPlan(n));
+    entry.bytes = n * sizeof(int) + (n / 2) * sizeof(std::pair<double, double>);
+
+    std::lock_guard<std::mutex> guard(cacheLock);
+    cacheInsert(key, entry);
+    return entry.plan;
+}
+
+/*
+Returns the cache key part that names irFilename as it is on disk. The
+file's size and modification time are included, so an IR overwritten on
+disk is loaded afresh instead of served from the cache
+*/
+static std::string irIdentity(std::string const& irFilename) {
+
+    struct stat status;
+    if (stat(irFilename.c_str(), &status) != 0) {
+        memset(&status, 0, sizeof(status));
+    }
+    return to_string((long long)status.st_size) + ":" + to_string((long long)status.st_mtim.tv_sec) + "." +
+           to_string((long long)status.st_mtim.tv_nsec) + ":" + irFilename;
+}
+
+/*
+Returns the IR channels stored in irFilename brought to targetRate by
+loadIRFile, loading them on a miss. Returns nullptr if the file cannot be
+used. hit is cleared on a miss
+*/
+static std::shared_ptr<std::vector<std::vector<double>>> getIR(std::string irFilename, std::string const& identity,
+                                                               int targetRate, bool *hit) {
+
+    std::string key = "irdata:" + to_string(targetRate) + ":" + identity;
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        cacheEntry *entry = cacheFind(key);
+        if (entry != nullptr) {
+            return entry->samples;
+        }
+    }
+    *hit = false;
+
+    std::vector<std::vector<double>> irChannels;
+    if (!loadIRFile(&irFilename[0], targetRate, &irChannels) || irChannels.empty()) {
+        return nullptr;
+    }
+
+    cacheEntry entry;
+    entry.bytes = (size_t)irChannels.size() * irChannels[0].size() * sizeof(double);
+    entry.samples = std::make_shared<std::vector<std::vector<double>>>(std::move(irChannels));
+
+    std::lock_guard<std::mutex> guard(cacheLock);
+    cacheInsert(key, entry);
+    return entry.samples;
+}
+
+/*
+Returns the size-n spectra of the already loaded IR channels, transforming
+them on a miss. hit is cleared on a miss
+*/
+static std::shared_ptr<std::vector<cl>> getIRSpectrum(std::vector<std::vector<double>> const& irChannels,
+                                                      std::string const& identity, int targetRate,
+                                                      fftPlan const& plan, bool *hit) {
+
+    std::string key = "ir:" + to_string(plan.n) + ":" + to_string(targetRate) + ":" + identity;
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        cacheEntry *entry = cacheFind(key);
+        if (entry != nullptr) {
+            return entry->spectrum;
+        }
+    }
+    *hit = false;
+
+    std::vector<cl> spectra;
+    for (size_t c = 0; c < irChannels.size(); c++) {
+        spectra.push_back(transformChannel(irChannels[c], plan));
+    }
+
+    cacheEntry entry;
+    entry.spectrum = std::make_shared<std::vector<cl>>(std::move(spectra));
+    entry.bytes = irChannels.size() * plan.n * sizeof(std::pair<double, double>);
+
+    std::lock_guard<std::mutex> guard(cacheLock);
+    cacheInsert(key, entry);
+    return entry.spectrum;
+}
+
+/*
+Waits until the client has data or the request deadline passes. Returns
+false once the deadline has passed
+*/
+static bool waitReadable(int client, clk::time_point deadline) {
+
+    while (true) {
+        long long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clk::now()).count();
+        if (remaining <= 0) {
+            return false;
+        }
+        struct pollfd waiting;
+        waiting.fd = client;
+        waiting.events = POLLIN;
+        int ready = poll(&waiting, 1, (int)min(remaining, 1000LL));
+        if (ready > 0) {
+            return true;
+        }
+        if (ready < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+static bool readExactly(int client, void *buffer, size_t size, clk::time_point deadline) {
+
+    size_t received = 0;
+    while (received < size) {
+        if (!waitReadable(client, deadline)) {
+            return false;
+        }
+        ssize_t count = read(client, (char *)buffer + received, size - received);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        received += count;
+    }
+    return true;
+}
+
+/*
+Runs one job to completion. Returns an empty string on success, otherwise
+a description of what went wrong
+*/
+static std::string processJob(renderJob &job, bool *cacheHit) {
+
+    std::vector<std::vector<double>> inputChannels;
+    wavInfo input;
+    if (job.inlinePCM) {
+        input.channels = job.pcmChannels;
+        input.sampleRate = job.pcmRate;
+        input.format = job.pcmFormat;
+        inputChannels.assign(job.pcmChannels, std::vector<double>(job.pcmFrames));
+        std::vector<double *> planes(job.pcmChannels);
+        for (int c = 0; c < job.pcmChannels; c++) {
+            planes[c] = inputChannels[c].data();
+        }
+        decodeSamples(job.pcmData.data(), job.pcmFormat, job.pcmFrames, job.pcmChannels, planes.data());
+    } else {
+        FILE *inputFile = fopen(job.input.c_str(), "rb");
+        if (inputFile == nullptr) {
+            return "unable to open wav file " + job.input;
+        }
+        if (!readWavFileHeader(&input, inputFile)) {
+            return "unsupported wav file " + job.input;
+        }
+        inputChannels = readWavFile(input, &job.input[0]);
+    }
+
+    //The transform is sized from the IR as loaded, after any resampling, so its tail is never cut off
+    std::string identity = irIdentity(job.ir);
+    *cacheHit = true;
+    std::shared_ptr<std::vector<std::vector<double>>> irChannels = getIR(job.ir, identity, input.sampleRate, cacheHit);
+    if (irChannels == nullptr) {
+        return "unable to load IR file " + job.ir;
+    }
+    int irSize = (*irChannels)[0].size();
+    int maxSize = max((int)inputChannels[0].size(), irSize);
+    if (maxSize == 0) {
+        return "empty input";
+    }
+
+    //Room for the full linear convolution, so the tail does not wrap onto the start
+    int n = nextPowerOfTwo(max(1, (int)inputChannels[0].size() + irSize - 1));
+
+    std::shared_ptr<fftPlan> plan = getPlan(n);
+    std::shared_ptr<std::vector<cl>> irSpectra = getIRSpectrum(*irChannels, identity, input.sampleRate, *plan, cacheHit);
+
+    std::vector<std::vector<double>> outputChannels(input.channels);
+    for (int c = 0; c < input.channels; c++) {
+        outputChannels[c] = convolveChannel(inputChannels[c], (*irSpectra)[c % irSpectra->size()], *plan, maxSize);
+    }
+    writeWavFile(outputChannels, input.sampleRate, input.format, &job.output[0]);
+    return "";
+}
+
+/*
+Sends the one-line answer and closes the connection. A client that has
+already hung up is counted as dropped; MSG_NOSIGNAL keeps its closed
+socket from raising SIGPIPE
+*/
+static void reply(int client, std::string const& line) {
+
+    std::string message = line + "\n";
+    size_t sent = 0;
+    while (sent < message.size()) {
+        ssize_t written = send(client, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            std::lock_guard<std::mutex> guard(statsLock);
+            droppedClients++;
+            break;
+        }
+        sent += written;
+    }
+    close(client);
+}
+
+static void workerLoop() {
+
+    while (true) {
+        renderJob job;
+        {
+            std::unique_lock<std::mutex> guard(queueLock);
+            queueReady.wait(guard, [] { return shuttingDown || !jobQueue.empty(); });
+            if (jobQueue.empty()) {
+                return;
+            }
+            job = std::move(jobQueue.front());
+            jobQueue.pop_front();
+        }
+        {
+            std::lock_guard<std::mutex> guard(statsLock);
+            activeJobs++;
+        }
+
+        clk::time_point started = clk::now();
+        bool cacheHit = false;
+        std::string error = processJob(job, &cacheHit);
+        clk::time_point finished = clk::now();
+
+        double waitMs = std::chrono::duration<double, std::milli>(started - job.queued).count();
+        double renderMs = std::chrono::duration<double, std::milli>(finished - started).count();
+        {
+            std::lock_guard<std::mutex> guard(statsLock);
+            activeJobs--;
+            if (error.empty()) {
+                recentLatencyMs[completedJobs % LATENCY_WINDOW] = waitMs + renderMs;
+                completedJobs++;
+                totalLatencyMs += waitMs + renderMs;
+                maxLatencyMs = max(maxLatencyMs, waitMs + renderMs);
+                if (cacheHit) {
+                    cacheHits++;
+                } else {
+                    cacheMisses++;
+                }
+            } else {
+                failedJobs++;
+            }
+        }
+
+        char line[256];
+        if (error.empty()) {
+            snprintf(line, sizeof(line), "OK wait_ms=%.2f render_ms=%.2f ir_cached=%d",
+                     waitMs, renderMs, cacheHit ? 1 : 0);
+            reply(job.client, line);
+        } else {
+            reply(job.client, "ERR " + error);
+        }
+    }
+}
+
+static std::string statsLine() {
+
+    size_t depth;
+    {
+        std::lock_guard<std::mutex> guard(queueLock);
+        depth = jobQueue.size();
+    }
+    size_t entries;
+    size_t bytes;
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        entries = cacheEntries.size();
+        bytes = cacheBytes;
+    }
+
+    std::lock_guard<std::mutex> guard(statsLock);
+    int window = (int)min((long)LATENCY_WINDOW, completedJobs);
+    std::vector<double> recent(recentLatencyMs, recentLatencyMs + window);
+    std::sort(recent.begin(), recent.end());
+    double p95 = window > 0 ? recent[(window - 1) * 95 / 100] : 0;
+    double average = completedJobs > 0 ? totalLatencyMs / completedJobs : 0;
+
+    char line[512];
+    snprintf(line, sizeof(line),
+             "OK queue=%zu active=%d done=%ld failed=%ld dropped=%ld cache_entries=%zu cache_mb=%.1f "
+             "ir_hits=%ld ir_misses=%ld avg_ms=%.2f p95_ms=%.2f max_ms=%.2f",
+             depth, activeJobs, completedJobs, failedJobs, droppedClients, entries, bytes / 1048576.0,
+             cacheHits, cacheMisses, average, p95, maxLatencyMs);
+    return line;
+}
+
+/*
+Reads up to and including the next newline. Returns false if the client
+hung up, missed the request deadline or sent an overlong line first
+*/
+static bool readLine(int client, std::string *line, clk::time_point deadline) {
+
+    char c;
+    line->clear();
+    while (readExactly(client, &c, 1, deadline)) {
+        if (c == '\n') {
+            return true;
+        }
+        line->push_back(c);
+        if (line->size() > REQUEST_MAX_LINE) {
+            return false;
+        }
+    }
+    return false;
+}
+
+/*
+Reads and parses one request, then either queues it for the workers or
+answers it directly. Runs on its own thread, so a client that trickles its
+request in never holds up the accept loop or a worker; the whole request,
+PCM payload included, must arrive within CLIENT_TIMEOUT
+*/
+static void handleClient(int client) {
+
+    clk::time_point deadline = clk::now() + std::chrono::seconds(CLIENT_TIMEOUT);
+    std::string line;
+    if (!readLine(client, &line, deadline)) {
+        close(client);
+        return;
+    }
+
+    char command[16];
+    char first[4096];
+    char second[4096];
+    char third[4096];
+    int rate = DEFAULT_PCM_RATE;
+    int channels = 1;
+    char formatName[16] = "int16";
+    int fields = sscanf(line.c_str(), "%15s %4095s %4095s %4095s %d %d %15s",
+                        command, first, second, third, &rate, &channels, formatName);
+    if (fields < 1) {
+        reply(client, "ERR empty request");
+        return;
+    }
+
+    if (strcmp(command, "STATS") == 0) {
+        reply(client, statsLine());
+        return;
+    }
+    if (strcmp(command, "SHUTDOWN") == 0) {
+        reply(client, "OK shutting down");
+        char wake = 1;
+        if (write(wakePipe[1], &wake, 1) < 0) {
+            perror("SHUTDOWN");
+        }
+        return;
+    }
+
+    renderJob job;
+    job.client = client;
+    job.pcmRate = rate;
+    job.pcmChannels = channels;
+    job.inlinePCM = false;
+
+    if (strcmp(command, "RENDER") == 0 && fields == 4) {
+        job.input = first;
+    } else if (strcmp(command, "PCM") == 0 && fields >= 4) {
+        long frames = atol(first);
+        if (frames <= 0 || rate <= 0 || channels <= 0 || frames > PCM_MAX_SAMPLES / channels) {
+            reply(client, "ERR bad frame count, rate or channel count");
+            return;
+        }
+        if (!parseSampleFormat(formatName, &job.pcmFormat)) {
+            reply(client, "ERR unknown sample format");
+            return;
+        }
+        job.inlinePCM = true;
+        job.pcmFrames = frames;
+        job.pcmData.resize((size_t)frames * channels * bytesPerSample(job.pcmFormat));
+        if (!readExactly(client, job.pcmData.data(), job.pcmData.size(), deadline)) {
+            reply(client, "ERR truncated PCM payload");
+            return;
+        }
+    } else {
+        reply(client, "ERR unknown request");
+        return;
+    }
+    job.ir = second;
+    job.output = third;
+    job.queued = clk::now();
+
+    {
+        std::lock_guard<std::mutex> guard(queueLock);
+        jobQueue.push_back(std::move(job));
+    }
+    queueReady.notify_one();
+}
+
+static void pendingClientThread(int client) {
+
+    handleClient(client);
+    std::lock_guard<std::mutex> guard(pendingLock);
+    pendingClients--;
+    pendingDone.notify_all();
+}
+
+int runDaemon(char *socketPath, size_t budget, int workers) {
+
+    cacheBudget = budget;
+
+    //Writes to a client that hung up must fail with EPIPE, not end the daemon
+    signal(SIGPIPE, SIG_IGN);
+    if (workers < 1) {
+        workers = 1;
+    }
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socketPath);
+        return 1;
+    }
+    strcpy(address.sun_path, socketPath);
+    unlink(socketPath);
+
+    if (bind(server, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(server, 64) < 0) {
+        perror(socketPath);
+        close(server);
+        return 1;
+    }
+    if (pipe(wakePipe) < 0) {
+        perror("pipe");
+        close(server);
+        return 1;
+    }
+
+    printf("Listening on %s with %d workers and a %zu MB cache\n", socketPath, workers, budget / 1048576);
+    fflush(stdout);
+
+    std::vector<std::thread> pool;
+    for (int i = 0; i < workers; i++) {
+        pool.push_back(std::thread(workerLoop));
+    }
+
+    while (true) {
+        //Wait for a connection or for a SHUTDOWN request to write to the wake pipe
+        struct pollfd waiting[2];
+        waiting[0].fd = server;
+        waiting[0].events = POLLIN;
+        waiting[1].fd = wakePipe[0];
+        waiting[1].events = POLLIN;
+        if (poll(waiting, 2, -1) < 0) {
+            continue;
+        }
+        if (waiting[1].revents != 0) {
+            break;
+        }
+
+        int client = accept(server, nullptr, nullptr);
+        if (client < 0) {
+            //Out of descriptors or memory: give running jobs a moment to release some
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                perror("accept");
+                std::this_thread::sleep_for(std::chrono::milliseconds(ACCEPT_BACKOFF_MS));
+            }
+            continue;
+        }
+
+        bool full;
+        {
+            std::lock_guard<std::mutex> guard(pendingLock);
+            full = pendingClients >= MAX_PENDING_CLIENTS;
+            if (!full) {
+                pendingClients++;
+            }
+        }
+        if (full) {
+            reply(client, "ERR too many pending requests");
+            continue;
+        }
+        std::thread(pendingClientThread, client).detach();
+    }
+
+    //Requests still being read finish within CLIENT_TIMEOUT and may yet queue a job
+    {
+        std::unique_lock<std::mutex> guard(pendingLock);
+        pendingDone.wait(guard, [] { return pendingClients == 0; });
+    }
+
+    //Let the workers drain whatever is already queued before exiting
+    {
+        std::lock_guard<std::mutex> guard(queueLock);
+        shuttingDown = true;
+    }
+    queueReady.notify_all();
+    for (std::thread &worker : pool) {
+        worker.join();
+    }
+
+    close(server);
+    close(wakePipe[0]);
+    close(wakePipe[1]);
+    unlink(socketPath);
+    printf("%s\n", statsLine().c_str() + 3);
+    return 0;
+}
@@ -0,0 +1,8 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stddef.h>
+
+int runDaemon(char *socketPath, size_t cacheBudget, int workers);
+
+#endif
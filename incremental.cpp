@@ -0,0 +1,475 @@
+/*
+	Incremental re-rendering of edited inputs
+
+	The input is cut into fixed segments of segmentSeconds and the stitched
+	result of overlap-adding every segment's full linear convolution is
+	kept as doubles in <output>.cache/mix.raw. The manifest next to it
+	holds a hash of each segment's input bytes and the peak of each
+	segment-sized block of the mix.
+
+	On the next run the input is hashed again. For every run of changed
+	segments only the mix range they feed, from the first changed segment
+	to the end of the last one's IR tail, is rebuilt: the few segments
+	overlapping that range are read back from the input and convolved
+	again, and added in the same order as a full build, so the range is
+	bit-identical to what a full rebuild would produce. The output wav is
+	then patched in place over the same ranges, as long as it is still the
+	file written last time (same size and modification time), is not being
+	resampled, and the global peak, and with it the normalising scale
+	writeWavFile applies, has not changed. Otherwise the whole output is
+	re-encoded from the mix, but nothing is convolved again. A 2 s edit
+	therefore costs one hash pass over the input plus a handful of
+	segment-sized convolutions and writes.
+
+	The manifest is deleted before the mix is touched and written again
+	only once the mix and the output are complete, so a run that dies in
+	between leaves no manifest, and the next run rebuilds from scratch
+	rather than trusting hashes that no longer describe the mix.
+
+	The manifest also records the segment length, sample rate, channel
+	count, input length and a hash of the IR, and any change to those
+	discards the whole cache. Edits that change the file's length shift
+	every later segment, so only in-place edits are cheap.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "complex_functions.h"
+#include "shard.h"
+#include "incremental.h"
+
+// Starting value and multiplier of the 64-bit FNV-1a hash
+#define FNV_OFFSET			0xcbf29ce484222325ULL
+#define FNV_PRIME			0x100000001b3ULL
+
+// Size in bytes of the header writeShardFile puts before the mix's samples
+#define MIX_HEADER_SIZE		12
+
+using namespace std;
+
+//everything the cache depends on besides the input bytes
+struct cacheKey
+{
+    long long           segmentFrames;
+    int                 sampleRate;
+    int                 channels;
+    long long           frames;
+    uint64_t            irHash;
+};
+
+//what the manifest records about the mix and the output written from it
+struct cacheState
+{
+    std::vector<uint64_t>   hashes;         //per input segment
+    std::vector<double>     peaks;          //largest magnitude in each segment-sized block of the mix
+    bool                    patchable;      //the output was written straight from the mix, not resampled
+    int                     outputFormat;
+    double                  scale;
+    long long               outputSize;
+    long long               outputTime;     //modification time in ns
+};
+
+/*
+FNV-1a over 64-bit words rather than bytes, with a fold of the high half
+into the low half after each multiply so that changes in the top bits of
+a word reach the whole hash. Any tail shorter than a word is hashed
+bytewise
+*/
+static uint64_t hashBytes(const void *data, size_t size, uint64_t hash) {
+
+    const uint8_t *bytes = (const uint8_t *)data;
+    size_t words = size / sizeof(uint64_t);
+    for (size_t i = 0; i < words; i++) {
+        uint64_t word;
+        memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(word));
+        hash = (hash ^ word) * FNV_PRIME;
+        hash ^= hash >> 32;
+    }
+    for (size_t i = words * sizeof(uint64_t); i < size; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+Reads the manifest into state. Returns false if there is none or it was
+made with a different key, in which case the whole cache is rebuilt
+*/
+static bool readManifest(std::string const& manifestFilename, cacheKey const& key, cacheState *state) {
+
+    FILE *manifest = fopen(manifestFilename.c_str(), "r");
+    if (manifest == nullptr) {
+        return false;
+    }
+
+    cacheKey recorded;
+    unsigned long long irHash;
+    long long segments;
+    long long blocks;
+    int patchable;
+    bool valid = fscanf(manifest, "incremental 2 segment %lld rate %d channels %d frames %lld ir %llx\n",
+                        &recorded.segmentFrames, &recorded.sampleRate, &recorded.channels, &recorded.frames, &irHash) == 5 &&
+                 recorded.segmentFrames == key.segmentFrames && recorded.sampleRate == key.sampleRate &&
+                 recorded.channels == key.channels && recorded.frames == key.frames && irHash == key.irHash;
+    valid = valid && fscanf(manifest, "output %d format %d scale %la size %lld time %lld\n", &patchable,
+                            &state->outputFormat, &state->scale, &state->outputSize, &state->outputTime) == 5;
+    valid = valid && fscanf(manifest, "segments %lld blocks %lld\n", &segments, &blocks) == 2 && segments >= 0 && blocks >= 0;
+    state->patchable = patchable != 0;
+
+    unsigned long long hash;
+    for (long long s = 0; valid && s < segments; s++) {
+        valid = fscanf(manifest, "%llx", &hash) == 1;
+        state->hashes.push_back(hash);
+    }
+    double peak;
+    for (long long b = 0; valid && b < blocks; b++) {
+        valid = fscanf(manifest, "%la", &peak) == 1;
+        state->peaks.push_back(peak);
+    }
+    fclose(manifest);
+    return valid;
+}
+
+static bool writeManifest(std::string const& manifestFilename, cacheKey const& key, cacheState const& state) {
+
+    FILE *manifest = fopen(manifestFilename.c_str(), "w");
+    if (manifest == nullptr) {
+        return false;
+    }
+    fprintf(manifest, "incremental 2 segment %lld rate %d channels %d frames %lld ir %016llx\n",
+            key.segmentFrames, key.sampleRate, key.channels, key.frames, (unsigned long long)key.irHash);
+    fprintf(manifest, "output %d format %d scale %a size %lld time %lld\n", state.patchable ? 1 : 0,
+            state.outputFormat, state.scale, state.outputSize, state.outputTime);
+    fprintf(manifest, "segments %zu blocks %zu\n", state.hashes.size(), state.peaks.size());
+    for (size_t s = 0; s < state.hashes.size(); s++) {
+        fprintf(manifest, "%016llx\n", (unsigned long long)state.hashes[s]);
+    }
+    //Hexadecimal floats round-trip exactly, so the scale comparison is exact too
+    for (size_t b = 0; b < state.peaks.size(); b++) {
+        fprintf(manifest, "%a\n", state.peaks[b]);
+    }
+    return fclose(manifest) == 0;
+}
+
+//size and modification time of filename, or false if it does not exist
+static bool fileIdentity(const char *filename, long long *size, long long *time) {
+
+    struct stat status;
+    if (stat(filename, &status) != 0) {
+        return false;
+    }
+    *size = status.st_size;
+    *time = status.st_mtim.tv_sec * 1000000000LL + status.st_mtim.tv_nsec;
+    return true;
+}
+
+/*
+Convolves one segment and adds the part of its linear result that falls in
+[rangeStart, rangeStart + range[0].size()) into range. The segment starts
+at frame start of the input
+*/
+static void addSegment(std::vector<std::vector<double>> const& segment, long long start,
+                       std::vector<cl> const& irSpectra, fftPlan const& plan, int irSize,
+                       std::vector<std::vector<double>> &range, long long rangeStart) {
+
+    long long length = range[0].size();
+    int linearSize = segment[0].size() + irSize - 1;
+    for (size_t c = 0; c < segment.size(); c++) {
+        std::vector<double> result = convolveChannel(segment[c], irSpectra[c % irSpectra.size()], plan, linearSize);
+        long long first = max(start, rangeStart);
+        long long last = min(start + linearSize, rangeStart + length);
+        for (long long i = first; i < last; i++) {
+            range[c][i - rangeStart] += result[i - start];
+        }
+    }
+}
+
+//largest magnitude over every channel of frames [first, last) of channels, which start at frame offset
+static double peakOf(std::vector<std::vector<double>> const& channels, long long offset, long long first, long long last) {
+
+    double peak = 0;
+    for (size_t c = 0; c < channels.size(); c++) {
+        for (long long i = first; i < last; i++) {
+            peak = max(peak, fabs(channels[c][i - offset]));
+        }
+    }
+    return peak;
+}
+
+/*
+Overwrites frames [start, start + range[0].size()) of the mix file, which
+holds mixFrames frames per channel in writeShardFile's planar layout
+*/
+static bool writeMixRange(std::string const& mixFilename, long long mixFrames, long long start,
+                          std::vector<std::vector<double>> const& range) {
+
+    FILE *mix = fopen(mixFilename.c_str(), "r+b");
+    if (mix == nullptr) {
+        return false;
+    }
+    bool written = true;
+    for (size_t c = 0; c < range.size(); c++) {
+        fseeko(mix, MIX_HEADER_SIZE + ((long long)c * mixFrames + start) * (long long)sizeof(double), SEEK_SET);
+        written = written && fwrite(range[c].data(), sizeof(double), range[c].size(), mix) == range[c].size();
+    }
+    return fclose(mix) == 0 && written;
+}
+
+/*
+Renders inputFilename like renderFile, rebuilding only the parts of the
+mix and output affected by segments whose input changed since the last
+incremental render to the same outputFilename
+*/
+int renderIncremental(char *inputFilename, char *irFilename, char *outputFilename, double segmentSeconds,
+                      int outputRate, sampleFormat *outputFormat) {
+
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+    FILE *inputFile = fopen(inputFilename, "rb");
+    wavInfo input;
+    printf("Reading wav file %s...\n", inputFilename);
+    if (inputFile == nullptr || !readWavFileHeader(&input, inputFile)) {
+        fprintf(stderr, "Unable to read wav file: %s\n", inputFilename);
+        return 1;
+    }
+
+    printf("Reading IR file %s...\n", irFilename);
+    std::vector<std::vector<double>> irChannels;
+    if (!loadIRFile(irFilename, input.sampleRate, &irChannels)) {
+        return 1;
+    }
+
+    cacheKey key;
+    key.segmentFrames = max(1LL, (long long)(segmentSeconds * input.sampleRate));
+    key.sampleRate = input.sampleRate;
+    key.channels = input.channels;
+    key.frames = input.frames;
+    key.irHash = FNV_OFFSET;
+    for (size_t c = 0; c < irChannels.size(); c++) {
+        key.irHash = hashBytes(irChannels[c].data(), irChannels[c].size() * sizeof(double), key.irHash);
+    }
+
+    std::string cacheDirectory = std::string(outputFilename) + ".cache";
+    std::string manifestFilename = cacheDirectory + "/manifest";
+    std::string mixFilename = cacheDirectory + "/mix.raw";
+    mkdir(cacheDirectory.c_str(), 0755);
+
+    //Every full segment has the same linear size, so one plan and one set of IR spectra serve them all
+    long long segmentFrames = key.segmentFrames;
+    int irSize = irChannels[0].size();
+    long long mixFrames = max(input.frames, (long long)irSize);
+    long long segments = (input.frames + segmentFrames - 1) / segmentFrames;
+    long long blocks = (mixFrames + segmentFrames - 1) / segmentFrames;
+    fftPlan plan = makeFFTPlan(nextPowerOfTwo(segmentFrames + irSize - 1));
+    std::vector<cl> irSpectra;
+    for (size_t c = 0; c < irChannels.size(); c++) {
+        irSpectra.push_back(transformChannel(irChannels[c], plan));
+    }
+
+    cacheState previous;
+    long long mixSize;
+    long long mixTime;
+    bool reuse = readManifest(manifestFilename, key, &previous) &&
+                 (long long)previous.hashes.size() == segments && (long long)previous.peaks.size() == blocks &&
+                 fileIdentity(mixFilename.c_str(), &mixSize, &mixTime) &&
+                 mixSize == MIX_HEADER_SIZE + (long long)input.channels * mixFrames * (long long)sizeof(double);
+
+    cacheState state;
+    state.hashes.resize(segments);
+    state.peaks = reuse ? previous.peaks : std::vector<double>(blocks, 0);
+
+    //Without a usable cache the whole mix is built in memory during the hash pass
+    std::vector<std::vector<double>> mix;
+    if (!reuse) {
+        mix.assign(input.channels, std::vector<double>(mixFrames, 0));
+    }
+
+    size_t frameSize = (size_t)bytesPerSample(input.format) * input.channels;
+    std::vector<uint8_t> raw(segmentFrames * frameSize);
+    std::vector<std::vector<double>> segment(input.channels);
+    std::vector<double *> planes(input.channels);
+    std::vector<long long> changed;
+
+    FILE *data = fopen(inputFilename, "rb");
+    if (data == nullptr) {
+        return 1;
+    }
+    fseeko(data, input.dataOffset, SEEK_SET);
+
+    for (long long s = 0; s < segments; s++) {
+        long long start = s * segmentFrames;
+        long long count = min(segmentFrames, input.frames - start);
+        size_t got = fread(raw.data(), frameSize, count, data);
+        if ((long long)got < count) {
+            fprintf(stderr, "Unable to read wav file: %s\n", inputFilename);
+            fclose(data);
+            return 1;
+        }
+        state.hashes[s] = hashBytes(raw.data(), count * frameSize, FNV_OFFSET);
+        if (reuse) {
+            if (state.hashes[s] != previous.hashes[s]) {
+                changed.push_back(s);
+            }
+            continue;
+        }
+
+        //The bytes are already in memory for hashing, so decode them directly
+        for (int c = 0; c < input.channels; c++) {
+            segment[c].resize(count);
+            planes[c] = segment[c].data();
+        }
+        decodeSamples(raw.data(), input.format, count, input.channels, planes.data());
+        addSegment(segment, start, irSpectra, plan, irSize, mix, 0);
+    }
+    fclose(data);
+
+    //The old manifest must not outlive a mix that no longer matches it
+    if ((!reuse || !changed.empty()) && remove(manifestFilename.c_str()) != 0 && errno != ENOENT) {
+        perror(manifestFilename.c_str());
+        return 1;
+    }
+
+    //Mix ranges that were rebuilt, as [first, last) frame pairs aligned to
+    //blocks, and their new contents
+    std::vector<std::pair<long long, long long>> ranges;
+    std::vector<std::vector<std::vector<double>>> rebuiltRanges;
+    long long convolved = 0;
+
+    if (!reuse) {
+        convolved = segments;
+        for (long long b = 0; b < blocks; b++) {
+            state.peaks[b] = peakOf(mix, 0, b * segmentFrames, min(mixFrames, (b + 1) * segmentFrames));
+        }
+        if (!writeShardFile(mix, &mixFilename[0])) {
+            fprintf(stderr, "Unable to write cache file: %s\n", mixFilename.c_str());
+            return 1;
+        }
+    } else {
+        //A changed segment affects the mix from its start to the end of its IR tail;
+        //runs of changed segments whose ranges touch are rebuilt together
+        for (size_t k = 0; k < changed.size(); k++) {
+            long long first = changed[k] * segmentFrames;
+            long long last = min(mixFrames, changed[k] * segmentFrames + segmentFrames + irSize - 1);
+            last = min(mixFrames, (last + segmentFrames - 1) / segmentFrames * segmentFrames);
+            if (!ranges.empty() && first <= ranges.back().second) {
+                ranges.back().second = max(ranges.back().second, last);
+            } else {
+                ranges.push_back(make_pair(first, last));
+            }
+        }
+
+        for (std::pair<long long, long long> const& range : ranges) {
+            std::vector<std::vector<double>> rebuilt(input.channels, std::vector<double>(range.second - range.first, 0));
+
+            //Every segment whose linear result overlaps the range, added in ascending order as in a full build
+            long long firstSegment = max(0LL, (range.first - segmentFrames - irSize + 1) / segmentFrames);
+            long long lastSegment = min(segments - 1, (range.second - 1) / segmentFrames);
+            for (long long t = firstSegment; t <= lastSegment; t++) {
+                long long start = t * segmentFrames;
+                if (start + segmentFrames + irSize - 1 <= range.first) {
+                    continue;
+                }
+                addSegment(readWavFrames(input, inputFilename, start, segmentFrames), start,
+                           irSpectra, plan, irSize, rebuilt, range.first);
+                convolved++;
+            }
+
+            if (!writeMixRange(mixFilename, mixFrames, range.first, rebuilt)) {
+                fprintf(stderr, "Unable to write cache file: %s\n", mixFilename.c_str());
+                return 1;
+            }
+            for (long long b = range.first / segmentFrames; b * segmentFrames < range.second; b++) {
+                state.peaks[b] = peakOf(rebuilt, range.first, b * segmentFrames, min(range.second, (b + 1) * segmentFrames));
+            }
+            rebuiltRanges.push_back(std::move(rebuilt));
+        }
+    }
+
+    //writeWavFile scales by 1 / max(1, peak), so the scale only moves when the global peak does
+    double peak = 1;
+    for (long long b = 0; b < blocks; b++) {
+        peak = max(peak, state.peaks[b]);
+    }
+    sampleFormat format = outputFormat ? *outputFormat : input.format;
+    state.patchable = outputRate == 0 || outputRate == input.sampleRate;
+    state.outputFormat = format;
+    state.scale = 1.0 / peak;
+
+    //The output can be patched only if it is still exactly what was written from the mix last time
+    long long outputSize;
+    long long outputTime;
+    wavInfo output;
+    FILE *outputFile = nullptr;
+    bool patch = reuse && state.patchable && previous.patchable && previous.outputFormat == format &&
+                 previous.scale == state.scale && fileIdentity(outputFilename, &outputSize, &outputTime) &&
+                 outputSize == previous.outputSize && outputTime == previous.outputTime;
+    if (patch) {
+        //readWavFileHeader closes the file, so it is reopened for the writes
+        outputFile = fopen(outputFilename, "rb");
+        patch = outputFile != nullptr && readWavFileHeader(&output, outputFile) && output.frames == mixFrames &&
+                output.channels == input.channels && output.format == format;
+        outputFile = patch ? fopen(outputFilename, "r+b") : nullptr;
+    }
+
+    long long patched = 0;
+    if (outputFile != nullptr) {
+        size_t outputFrameSize = (size_t)bytesPerSample(format) * input.channels;
+        std::vector<uint8_t> encoded;
+        std::vector<double *> rangePlanes(input.channels);
+        bool written = true;
+        for (size_t r = 0; r < ranges.size(); r++) {
+            long long count = ranges[r].second - ranges[r].first;
+            for (int c = 0; c < input.channels; c++) {
+                rangePlanes[c] = rebuiltRanges[r][c].data();
+            }
+            encoded.resize(count * outputFrameSize);
+            encodeSamples(rangePlanes.data(), input.channels, count, state.scale, format, encoded.data());
+            fseeko(outputFile, output.dataOffset + ranges[r].first * (long long)outputFrameSize, SEEK_SET);
+            written = written && fwrite(encoded.data(), outputFrameSize, count, outputFile) == (size_t)count;
+            patched += count;
+        }
+        if (fclose(outputFile) != 0 || !written) {
+            fprintf(stderr, "Unable to write wav file: %s\n", outputFilename);
+            return 1;
+        }
+    } else {
+        //The whole output has to be re-encoded, from the mix in memory or on disk
+        if (reuse) {
+            mix.assign(input.channels, std::vector<double>(mixFrames, 0));
+            if (!addShardFile(mixFilename.c_str(), 0, mix)) {
+                fprintf(stderr, "Unable to read cache file: %s\n", mixFilename.c_str());
+                return 1;
+            }
+        }
+        writeOutput(mix, input, outputRate, outputFormat, outputFilename);
+        patched = -1;
+    }
+
+    if (!fileIdentity(outputFilename, &state.outputSize, &state.outputTime)) {
+        state.outputSize = -1;
+        state.outputTime = -1;
+    }
+    if (!writeManifest(manifestFilename, key, state)) {
+        fprintf(stderr, "Unable to write cache manifest: %s\n", manifestFilename.c_str());
+    }
+
+    double elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    long long edited = reuse ? (long long)changed.size() : segments;
+    if (patched >= 0) {
+        printf("%lld of %lld segments changed, convolved %lld and patched %lld of %lld output frames in place in %.1f ms\n",
+               edited, segments, convolved, patched, mixFrames, elapsedMs);
+    } else {
+        printf("%lld of %lld segments changed, convolved %lld and rewrote the output in %.1f ms\n",
+               edited, segments, convolved, elapsedMs);
+    }
+    printf("Finished\n");
+    return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "pcm.h"
+
+int renderIncremental(char *inputFilename, char *irFilename, char *outputFilename, double segmentSeconds,
+                      int outputRate, sampleFormat *outputFormat);
+
+#endif
@@ -0,0 +1,117 @@
+/*
+	Per-block latency histograms for the real-time path
+
+	A time v below 2^LATENCY_SUB_BITS ns has a bucket of its own. Above that,
+	each power of 2 [2^m, 2^(m+1)) is split into 2^(LATENCY_SUB_BITS-1)
+	equal buckets, so the bucket width grows with the value and the relative
+	error stays below 2^-(LATENCY_SUB_BITS-1) at any magnitude. Percentiles
+	are reported as the upper edge of their bucket, never below the true
+	value, and the maximum is tracked exactly
+*/
+
+#include <stdio.h>
+#include "latency.h"
+
+#define HALF_BUCKETS		(1 << (LATENCY_SUB_BITS - 1))
+
+//bucket index for a time in ns
+static int bucketIndex(int64_t nanoseconds) {
+
+    uint64_t v = nanoseconds < 0 ? 0 : (uint64_t)nanoseconds;
+    if (v < (1u << LATENCY_SUB_BITS)) {
+        return (int)v;
+    }
+    int magnitude = 63 - __builtin_clzll(v);
+    if (magnitude > LATENCY_MAX_BITS) {
+        return LATENCY_BUCKETS - 1;
+    }
+    int shift = magnitude - LATENCY_SUB_BITS + 1;
+    return (1 << LATENCY_SUB_BITS) + (shift - 1) * HALF_BUCKETS + (int)((v >> shift) - HALF_BUCKETS);
+}
+
+//largest time in ns that falls in bucket index
+static int64_t bucketUpperEdge(int index) {
+
+    if (index < (1 << LATENCY_SUB_BITS)) {
+        return index;
+    }
+    int shift = (index - (1 << LATENCY_SUB_BITS)) / HALF_BUCKETS + 1;
+    int64_t sub = (index - (1 << LATENCY_SUB_BITS)) % HALF_BUCKETS + HALF_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void initLatencyHistogram(latencyHistogram *histogram, int64_t deadline) {
+
+    histogram->deadline = deadline;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        histogram->counts[i].store(0, std::memory_order_relaxed);
+    }
+    histogram->total.store(0, std::memory_order_relaxed);
+    histogram->overruns.store(0, std::memory_order_relaxed);
+    histogram->maximum.store(0, std::memory_order_relaxed);
+}
+
+/*
+Adds one time. Safe from the audio thread: no allocation, no locks, and
+the counts are relaxed atomics so readers see them without tearing
+*/
+void recordLatency(latencyHistogram *histogram, int64_t nanoseconds) {
+
+    histogram->counts[bucketIndex(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    histogram->total.fetch_add(1, std::memory_order_relaxed);
+    if (histogram->deadline > 0 && nanoseconds > histogram->deadline) {
+        histogram->overruns.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    int64_t seen = histogram->maximum.load(std::memory_order_relaxed);
+    while (nanoseconds > seen && !histogram->maximum.compare_exchange_weak(seen, nanoseconds, std::memory_order_relaxed)) {
+    }
+}
+
+/*
+Smallest bucket edge at or above the given percentile (0-100) of the
+recorded times, capped at the exact maximum. 0 if nothing was recorded
+*/
+int64_t latencyPercentile(latencyHistogram const *histogram, double percentile) {
+
+    uint64_t total = histogram->total.load(std::memory_order_relaxed);
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    int64_t maximum = histogram->maximum.load(std::memory_order_relaxed);
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            int64_t edge = bucketUpperEdge(i);
+            return edge < maximum ? edge : maximum;
+        }
+    }
+    return maximum;
+}
+
+/*
+Prints count, percentiles and overruns in microseconds, with each
+percentile also given as a fraction of the deadline
+*/
+void printLatencyReport(latencyHistogram const *histogram, const char *what) {
+
+    uint64_t total = histogram->total.load(std::memory_order_relaxed);
+    double deadline = histogram->deadline / 1000.0;
+    printf("%s: %llu blocks, deadline %.1f us\n", what, (unsigned long long)total, deadline);
+
+    const double percentiles[] = {50, 99, 99.9};
+    const char *names[] = {"p50", "p99", "p99.9"};
+    for (int i = 0; i < 3; i++) {
+        double value = latencyPercentile(histogram, percentiles[i]) / 1000.0;
+        printf("  %-6s %10.1f us  %5.1f%%\n", names[i], value, deadline > 0 ? 100 * value / deadline : 0);
+    }
+    double maximum = histogram->maximum.load(std::memory_order_relaxed) / 1000.0;
+    printf("  %-6s %10.1f us  %5.1f%%\n", "max", maximum, deadline > 0 ? 100 * maximum / deadline : 0);
+    printf("  overruns %llu\n", (unsigned long long)histogram->overruns.load(std::memory_order_relaxed));
+}
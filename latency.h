@@ -0,0 +1,32 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <atomic>
+
+// Linear sub-buckets per power of 2: 2^7 keeps every bucket within 1/64 of its value
+#define LATENCY_SUB_BITS	7
+// Largest time that gets its own bucket, 2^40 ns (about 18 minutes)
+#define LATENCY_MAX_BITS	40
+#define LATENCY_BUCKETS		((1 << LATENCY_SUB_BITS) + (LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * (1 << (LATENCY_SUB_BITS - 1)))
+
+/*
+Log-linear histogram of nanosecond times in the style of HdrHistogram.
+Recording is lock-free and wait-free apart from the max update, so it can
+be done from the audio thread while another thread reads the counts
+*/
+struct latencyHistogram
+{
+    int64_t                     deadline;           //ns; times above it count as overruns
+    std::atomic<uint64_t>       counts[LATENCY_BUCKETS];
+    std::atomic<uint64_t>       total;
+    std::atomic<uint64_t>       overruns;
+    std::atomic<int64_t>        maximum;
+};
+
+void initLatencyHistogram(latencyHistogram *histogram, int64_t deadline);
+void recordLatency(latencyHistogram *histogram, int64_t nanoseconds);
+int64_t latencyPercentile(latencyHistogram const *histogram, double percentile);
+void printLatencyReport(latencyHistogram const *histogram, const char *what);
+
+#endif
@@ -0,0 +1,243 @@
+/*
+	Multithreaded whole-file convolution
+
+	The transform buffers are split into one contiguous region per worker.
+	Each worker fills its own region first, so with allocateBuffer's untouched
+	pages the region lives on that worker's NUMA node, and with --pin the
+	worker stays there. The FFT then runs in two phases. Butterfly stages
+	whose blocks fit inside one region are done by each worker on its own
+	memory without synchronising. The last log2(threads) stages span regions
+	and split their n/2 butterflies evenly, with a barrier between stages.
+	The pointwise multiply and the copy-out are again region-local, and each
+	worker releases its slice of the output before writing it so those
+	pages are placed on its node too. Every worker, including the first,
+	runs on its own thread, so pinning never sticks to the caller.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include "complex_functions.h"
+#include "parallel.h"
+
+using namespace std;
+
+typedef std::pair<double, double> complexValue;
+
+//reusable barrier for a fixed number of threads
+struct teamBarrier
+{
+    std::mutex                  lock;
+    std::condition_variable     released;
+    int                         threads;
+    int                         waiting;
+    long                        generation;
+};
+
+static void waitAtBarrier(teamBarrier *barrier) {
+
+    std::unique_lock<std::mutex> guard(barrier->lock);
+    long generation = barrier->generation;
+    if (++barrier->waiting == barrier->threads) {
+        barrier->waiting = 0;
+        barrier->generation++;
+        barrier->released.notify_all();
+        return;
+    }
+    barrier->released.wait(guard, [barrier, generation] { return barrier->generation != generation; });
+}
+
+static inline void butterfly(complexValue *A, int lower, int upper, complexValue w) {
+
+    complexValue u = A[lower];
+    complexValue v = multiply(w, A[upper]);
+    A[lower].first = u.first + v.first;
+    A[lower].second = u.second + v.second;
+    A[upper].first = u.first - v.first;
+    A[upper].second = u.second - v.second;
+}
+
+/*
+Worker t's share of fft(A, plan, direction). Every worker of the team must
+call this together; it starts with a barrier so the input is complete
+*/
+static void parallelFFT(complexValue *A, fftPlan const& plan, int direction, int t, teamBarrier *barrier) {
+
+    int n = plan.n;
+    int threads = barrier->threads;
+    int region = n / threads;
+    int low = t * region;
+    int high = low + region;
+
+    waitAtBarrier(barrier);
+
+    //Each pair is swapped by the owner of its lower index only
+    for (int i = low; i < high; i++) {
+        int j = plan.bitReverse[i];
+        if (i < j) {
+            std::swap(A[i], A[j]);
+        }
+    }
+    waitAtBarrier(barrier);
+
+    for (int len = 2; len <= region; len += len) {
+        int half = len / 2;
+        int step = n / len;
+        for (int i = low; i < high; i += len) {
+            for (int k = 0; k < half; k++) {
+                complexValue w = plan.twiddles[k * step];
+                w.second *= direction;
+                butterfly(A, i + k, i + k + half, w);
+            }
+        }
+    }
+
+    for (int len = 2 * region; len <= n; len += len) {
+        waitAtBarrier(barrier);
+        int half = len / 2;
+        int step = n / len;
+        int share = n / 2 / threads;
+        for (int b = t * share; b < (t + 1) * share; b++) {
+            int k = b % half;
+            int i = (b / half) * len + k;
+            complexValue w = plan.twiddles[k * step];
+            w.second *= direction;
+            butterfly(A, i, i + half, w);
+        }
+    }
+
+    //The last stages wrote across regions, so everyone must finish before
+    //any region is scaled or read
+    waitAtBarrier(barrier);
+
+    if (direction == -1) {
+        double scale = 1.0 / n;
+        for (int i = low; i < high; i++) {
+            A[i].first *= scale;
+            A[i].second *= scale;
+        }
+    }
+}
+
+/*
+Fills worker t's region of buffer with samples, zero beyond their end
+*/
+static void fillRegion(complexValue *buffer, std::vector<double> const& samples, int low, int high) {
+
+    int available = min(high, (int)samples.size());
+    for (int i = low; i < available; i++) {
+        buffer[i].first = samples[i];
+        buffer[i].second = 0;
+    }
+    for (int i = max(low, available); i < high; i++) {
+        buffer[i].first = 0;
+        buffer[i].second = 0;
+    }
+}
+
+/*
+Same result as convolveChannels, computed by options.threads workers
+(rounded down to a power of 2) on buffers from allocateBuffer
+*/
+std::vector<std::vector<double>> convolveChannelsParallel(std::vector<std::vector<double>> const& inputChannels,
+                                                          std::vector<std::vector<double>> const& irChannels,
+                                                          int outputSize, parallelOptions const& options) {
+
+    int linearSize = inputChannels[0].size() + irChannels[0].size() - 1;
+    int n = nextPowerOfTwo(max(linearSize, 2));
+    fftPlan plan = makeFFTPlan(n);
+
+    int threads = 1;
+    while (threads * 2 <= options.threads && threads * 2 <= n / 2) {
+        threads *= 2;
+    }
+
+    //Spread workers across nodes so each node's memory bandwidth is used
+    std::vector<std::vector<int>> nodes = numaNodeCpus();
+    std::vector<int> cpus(threads);
+    for (int t = 0; t < threads; t++) {
+        std::vector<int> const& node = nodes[t % nodes.size()];
+        cpus[t] = node[(t / nodes.size()) % node.size()];
+    }
+
+    size_t bytes = (size_t)n * sizeof(complexValue);
+    hugePageMode used = HUGE_PAGES_OFF;
+    std::vector<complexValue *> irSpectra(irChannels.size());
+    for (size_t c = 0; c < irChannels.size(); c++) {
+        irSpectra[c] = (complexValue *)allocateBuffer(bytes, options.hugePages, &used);
+    }
+    complexValue *work = (complexValue *)allocateBuffer(bytes, options.hugePages, &used);
+
+    std::vector<std::vector<double>> outputChannels(inputChannels.size(), std::vector<double>(outputSize));
+    bool allocated = work != nullptr;
+    for (size_t c = 0; c < irSpectra.size(); c++) {
+        allocated = allocated && irSpectra[c] != nullptr;
+    }
+
+    if (allocated) {
+        printf("Convolving on %d threads across %zu NUMA node(s) with %s pages%s\n",
+               threads, nodes.size(), hugePageModeName(used), options.pin ? ", pinned" : "");
+
+        teamBarrier barrier;
+        barrier.threads = threads;
+        barrier.waiting = 0;
+        barrier.generation = 0;
+
+        std::function<void(int)> worker = [&](int t) {
+            if (options.pin) {
+                pinThread(cpus[t]);
+            }
+            int region = n / threads;
+            int low = t * region;
+            int high = low + region;
+
+            for (size_t c = 0; c < irChannels.size(); c++) {
+                fillRegion(irSpectra[c], irChannels[c], low, high);
+                parallelFFT(irSpectra[c], plan, 1, t, &barrier);
+            }
+
+            for (size_t c = 0; c < inputChannels.size(); c++) {
+                fillRegion(work, inputChannels[c], low, high);
+                parallelFFT(work, plan, 1, t, &barrier);
+
+                complexValue *ir = irSpectra[c % irSpectra.size()];
+                for (int i = low; i < high; i++) {
+                    work[i] = multiply(work[i], ir[i]);
+                }
+                parallelFFT(work, plan, -1, t, &barrier);
+
+                //The caller zero-filled the output; drop those pages so this worker's writes place them
+                int end = min(high, outputSize);
+                if (low < end) {
+                    releasePages(&outputChannels[c][low], (size_t)(end - low) * sizeof(double));
+                }
+                for (int i = low; i < end; i++) {
+                    outputChannels[c][i] = work[i].first;
+                }
+
+                //Nobody refills work until every worker has copied its region out
+                waitAtBarrier(&barrier);
+            }
+        };
+
+        std::vector<std::thread> team;
+        for (int t = 0; t < threads; t++) {
+            team.push_back(std::thread(worker, t));
+        }
+        for (std::thread &member : team) {
+            member.join();
+        }
+    } else {
+        fprintf(stderr, "Unable to allocate transform buffers, convolving on one thread\n");
+        outputChannels = convolveChannels(inputChannels, irChannels, outputSize);
+    }
+
+    for (size_t c = 0; c < irSpectra.size(); c++) {
+        freeBuffer(irSpectra[c], bytes);
+    }
+    freeBuffer(work, bytes);
+    return outputChannels;
+}
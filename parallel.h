@@ -0,0 +1,19 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <vector>
+#include "buffers.h"
+
+//how the whole-file convolution is spread over threads
+struct parallelOptions
+{
+    int             threads;
+    bool            pin;
+    hugePageMode    hugePages;
+};
+
+std::vector<std::vector<double>> convolveChannelsParallel(std::vector<std::vector<double>> const& inputChannels,
+                                                          std::vector<std::vector<double>> const& irChannels,
+                                                          int outputSize, parallelOptions const& options);
+
+#endif
@@ -0,0 +1,278 @@
+/*
+	Block-based convolution with glitch-free IR switching
+
+	The IR is cut into blockSize partitions, each zero-padded to 2*blockSize
+	and transformed once. Every block of input is transformed once too and
+	pushed into a frequency-domain delay line, so one block of output is the
+	inverse transform of sum_k X[newest - k] * H[k], of which the second half
+	is kept (overlap-save).
+
+	Switching IRs: stageIRFile loads, resamples, partitions and transforms the
+	new IR on a separate thread, then publishes it through engine->pending.
+	At the next block boundary processBlock takes it and, for fadeBlocks
+	blocks, accumulates the spectra of both IRs and mixes them with
+	equal-power gains before the single inverse transform. The delay line is
+	shared, so the new IR's tail is applied to the past input immediately and
+	the crossfade costs at most one extra multiply-accumulate pass per block.
+	The old IR is handed back through engine->retired to be freed off the
+	audio thread, and a further switch is only taken once that slot is empty
+*/
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <chrono>
+#include "partitioned.h"
+
+// Quarter turn, for the equal-power crossfade gains
+#define PI_HALF				1.57079632679490
+
+using namespace std;
+
+/*
+Transforms every partition of every IR channel. IRs longer than
+maxPartitions*blockSize are truncated, since the delay line cannot hold
+more history than that
+*/
+partitionedIR *partitionIR(std::vector<std::vector<double>> const& ir, int blockSize, int maxPartitions, fftPlan const& plan) {
+
+    partitionedIR *result = new partitionedIR;
+    result->channels = ir.size();
+    size_t length = ir.empty() ? 0 : ir[0].size();
+    result->partitions = (int)min((size_t)maxPartitions, (length + blockSize - 1) / blockSize);
+    if (result->partitions < 1) {
+        result->partitions = 1;
+    }
+    if ((size_t)result->partitions * blockSize < length) {
+        fprintf(stderr, "IR truncated to %d samples to fit the delay line\n", result->partitions * blockSize);
+    }
+
+    result->spectra.resize(result->channels);
+    for (int c = 0; c < result->channels; c++) {
+        for (int k = 0; k < result->partitions; k++) {
+            //Each partition occupies the first half of its window, the rest is zero
+            cl spectrum(plan.n);
+            for (int i = 0; i < blockSize; i++) {
+                size_t source = (size_t)k * blockSize + i;
+                spectrum[i].first = source < length ? ir[c][source] : 0;
+            }
+            fft(spectrum.data(), plan, 1);
+            result->spectra[c].push_back(std::move(spectrum));
+        }
+    }
+    return result;
+}
+
+/*
+Allocates everything processBlock will ever touch. blockSize must be a
+power of 2; maxPartitions bounds the longest IR that can be loaded
+*/
+void initBlockConvolver(blockConvolver *engine, int blockSize, int channels, int sampleRate, int maxPartitions, int fadeBlocks) {
+
+    engine->blockSize = blockSize;
+    engine->channels = channels;
+    engine->sampleRate = sampleRate;
+    engine->maxPartitions = maxPartitions;
+    engine->fadeBlocks = max(1, fadeBlocks);
+    engine->plan = makeFFTPlan(2 * blockSize);
+
+    engine->history.assign(channels, std::vector<double>(2 * blockSize, 0));
+    engine->delayLine.assign(channels, std::vector<cl>(maxPartitions, cl(2 * blockSize)));
+    engine->newest = 0;
+    engine->accumulator.assign(2 * blockSize, make_pair(0.0, 0.0));
+    engine->fadeAccumulator.assign(2 * blockSize, make_pair(0.0, 0.0));
+
+    engine->current = nullptr;
+    engine->previous = nullptr;
+    engine->fadePosition = 0;
+    engine->pending.store(nullptr);
+    engine->retired.store(nullptr);
+    engine->timing = nullptr;
+}
+
+void destroyBlockConvolver(blockConvolver *engine) {
+
+    waitForStagedIR(engine);
+    collectRetiredIR(engine);
+    delete engine->pending.exchange(nullptr);
+    delete engine->current;
+    delete engine->previous;
+    engine->current = nullptr;
+    engine->previous = nullptr;
+}
+
+/*
+Installs the first IR. Not real-time safe: call before audio starts
+*/
+void setIR(blockConvolver *engine, std::vector<std::vector<double>> const& ir) {
+
+    delete engine->current;
+    engine->current = partitionIR(ir, engine->blockSize, engine->maxPartitions, engine->plan);
+}
+
+/*
+Frees an IR the audio thread has finished crossfading away from
+*/
+void collectRetiredIR(blockConvolver *engine) {
+
+    delete engine->retired.exchange(nullptr);
+}
+
+/*
+Waits for the staging thread, if any, to publish its IR. Only the host
+calls this; the audio thread never waits on staging
+*/
+void waitForStagedIR(blockConvolver *engine) {
+
+    if (engine->stager.joinable()) {
+        engine->stager.join();
+    }
+}
+
+/*
+Starts loading the IR in filename on a background thread. When it is
+ready the audio thread crossfades to it at the next block boundary. If
+another staged IR has not been picked up yet it is replaced. The loading
+thread runs at normal priority even if the caller is real-time
+*/
+void stageIRFile(blockConvolver *engine, std::string filename) {
+
+    waitForStagedIR(engine);
+    engine->stager = std::thread([engine, filename]() {
+        //A new thread inherits SCHED_FIFO from a real-time caller; loading must not compete with the audio thread
+        sched_param param;
+        memset(&param, 0, sizeof(param));
+        pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+
+        std::vector<std::vector<double>> ir;
+        if (!loadIRFile(const_cast<char *>(filename.c_str()), engine->sampleRate, &ir)) {
+            return;
+        }
+
+        collectRetiredIR(engine);
+        partitionedIR *staged = partitionIR(ir, engine->blockSize, engine->maxPartitions, engine->plan);
+
+        //Anything swapped out here was never seen by the audio thread
+        delete engine->pending.exchange(staged);
+    });
+}
+
+bool isCrossfading(blockConvolver const *engine) {
+
+    return engine->previous != nullptr;
+}
+
+/*
+Sums X[newest - k] * H[k] over the IR's partitions into sum
+*/
+static void accumulate(blockConvolver *engine, int channel, partitionedIR const *ir, cl &sum) {
+
+    int n = engine->plan.n;
+    std::vector<cl> const& spectra = ir->spectra[channel % ir->channels];
+    std::vector<cl> const& delayLine = engine->delayLine[channel];
+
+    for (int i = 0; i < n; i++) {
+        sum[i].first = 0;
+        sum[i].second = 0;
+    }
+    for (int k = 0; k < ir->partitions; k++) {
+        int slot = (engine->newest - k + engine->maxPartitions) % engine->maxPartitions;
+        const std::pair<double, double> *x = delayLine[slot].data();
+        const std::pair<double, double> *h = spectra[k].data();
+        for (int i = 0; i < n; i++) {
+            sum[i].first += x[i].first * h[i].first - x[i].second * h[i].second;
+            sum[i].second += x[i].first * h[i].second + x[i].second * h[i].first;
+        }
+    }
+}
+
+/*
+Convolves one block of blockSize samples per channel. Runs on the audio
+thread: no allocation, no locks, bounded work
+*/
+static void convolveBlock(blockConvolver *engine, double *const *input, double **output) {
+
+    int blockSize = engine->blockSize;
+    int n = engine->plan.n;
+
+    //Take a staged IR only when no crossfade is running and the last retired IR has been collected
+    if (engine->previous == nullptr && engine->retired.load(std::memory_order_acquire) == nullptr) {
+        partitionedIR *staged = engine->pending.exchange(nullptr, std::memory_order_acq_rel);
+        if (staged != nullptr) {
+            engine->previous = engine->current;
+            engine->current = staged;
+            engine->fadePosition = 0;
+        }
+    }
+
+    engine->newest = (engine->newest + 1) % engine->maxPartitions;
+
+    //Equal-power gains, stepped once per block
+    double fadeIn = 1;
+    double fadeOut = 0;
+    if (engine->previous != nullptr) {
+        double t = (engine->fadePosition + 1) / (double)engine->fadeBlocks;
+        fadeIn = sin(t * PI_HALF);
+        fadeOut = cos(t * PI_HALF);
+    }
+
+    for (int c = 0; c < engine->channels; c++) {
+        std::vector<double> &history = engine->history[c];
+        memmove(history.data(), history.data() + blockSize, blockSize * sizeof(double));
+        memcpy(history.data() + blockSize, input[c], blockSize * sizeof(double));
+
+        cl &spectrum = engine->delayLine[c][engine->newest];
+        for (int i = 0; i < n; i++) {
+            spectrum[i].first = history[i];
+            spectrum[i].second = 0;
+        }
+        fft(spectrum.data(), engine->plan, 1);
+
+        if (engine->current == nullptr) {
+            memset(output[c], 0, blockSize * sizeof(double));
+            continue;
+        }
+
+        cl &sum = engine->accumulator;
+        accumulate(engine, c, engine->current, sum);
+        if (engine->previous != nullptr) {
+            cl &fadeSum = engine->fadeAccumulator;
+            accumulate(engine, c, engine->previous, fadeSum);
+            for (int i = 0; i < n; i++) {
+                sum[i].first = fadeIn * sum[i].first + fadeOut * fadeSum[i].first;
+                sum[i].second = fadeIn * sum[i].second + fadeOut * fadeSum[i].second;
+            }
+        }
+        fft(sum.data(), engine->plan, -1);
+
+        //The first half wraps around circularly, the second half is the linear result
+        for (int i = 0; i < blockSize; i++) {
+            output[c][i] = sum[blockSize + i].first;
+        }
+    }
+
+    if (engine->previous != nullptr && ++engine->fadePosition >= engine->fadeBlocks) {
+        engine->retired.store(engine->previous, std::memory_order_release);
+        engine->previous = nullptr;
+    }
+}
+
+/*
+processBlock for the audio thread. With engine->timing set, the time
+spent in the block is also recorded there; the clock reads and the
+histogram update are lock-free, so timing does not change the guarantees
+*/
+void processBlock(blockConvolver *engine, double *const *input, double **output) {
+
+    if (engine->timing == nullptr) {
+        convolveBlock(engine, input, output);
+        return;
+    }
+    auto started = std::chrono::steady_clock::now();
+    convolveBlock(engine, input, output);
+    auto elapsed = std::chrono::steady_clock::now() - started;
+    recordLatency(engine->timing, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
@@ -0,0 +1,62 @@
+#ifndef PARTITIONED_H
+#define PARTITIONED_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include "complex_functions.h"
+#include "latency.h"
+
+// Blocks over which the block engine crossfades to a newly staged IR
+#define CROSSFADE_BLOCKS	16
+
+//an IR cut into blockSize pieces, each transformed to size 2*blockSize
+struct partitionedIR
+{
+    int                             channels;
+    int                             partitions;
+    std::vector<std::vector<cl>>    spectra;        //[channel][partition]
+};
+
+/*
+Uniformly partitioned overlap-save convolver. processBlock runs on the
+audio thread and never allocates, locks or frees; new IRs are built on
+a staging thread and handed over through the pending/retired slots
+*/
+struct blockConvolver
+{
+    int                                 blockSize;
+    int                                 channels;
+    int                                 sampleRate;
+    int                                 maxPartitions;
+    int                                 fadeBlocks;
+    fftPlan                             plan;
+
+    std::vector<std::vector<double>>    history;        //[channel] last 2*blockSize input samples
+    std::vector<std::vector<cl>>        delayLine;      //[channel][maxPartitions] input spectra
+    int                                 newest;
+    cl                                  accumulator;
+    cl                                  fadeAccumulator;
+
+    partitionedIR                      *current;
+    partitionedIR                      *previous;
+    int                                 fadePosition;
+    std::atomic<partitionedIR *>        pending;
+    std::atomic<partitionedIR *>        retired;
+    std::thread                         stager;
+    latencyHistogram                   *timing;         //if not nullptr, every processBlock is timed into it
+};
+
+partitionedIR *partitionIR(std::vector<std::vector<double>> const& ir, int blockSize, int maxPartitions, fftPlan const& plan);
+
+void initBlockConvolver(blockConvolver *engine, int blockSize, int channels, int sampleRate, int maxPartitions, int fadeBlocks);
+void destroyBlockConvolver(blockConvolver *engine);
+void setIR(blockConvolver *engine, std::vector<std::vector<double>> const& ir);
+void stageIRFile(blockConvolver *engine, std::string filename);
+void waitForStagedIR(blockConvolver *engine);
+void collectRetiredIR(blockConvolver *engine);
+bool isCrossfading(blockConvolver const *engine);
+void processBlock(blockConvolver *engine, double *const *input, double **output);
+
+#endif
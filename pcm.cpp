@@ -0,0 +1,384 @@
+/*
+	Conversion between interleaved wav sample data and planar doubles
+
+	Decoding turns 16, 24 or 32-bit integer or 32-bit float samples into
+	doubles in the range [-1, 1) and splits the channels into separate planes
+	in the same pass. Encoding does the reverse, saturating anything outside
+	the range instead of letting it wrap. Mono and stereo data in every
+	format has SSE2 kernels in both directions, with packed 24-bit samples
+	spread into and gathered from int32 lanes by shifts and masks; other
+	channel counts and the few frames left over at the end of a buffer use
+	the scalar loops, which produce identical results
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "pcm.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Full-scale values of the integer formats
+#define INT16_SCALE			32768.0
+#define INT24_SCALE			8388608.0
+#define INT32_SCALE			2147483648.0
+
+int bytesPerSample(sampleFormat format) {
+
+    switch (format) {
+    case PCM_INT16:
+        return 2;
+    case PCM_INT24:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+//reads one little-endian sample of the given format as a double in [-1, 1)
+static inline double decodeOne(const uint8_t *p, sampleFormat format) {
+
+    switch (format) {
+    case PCM_INT16:
+        return (int16_t)(p[0] | (p[1] << 8)) / INT16_SCALE;
+    case PCM_INT24:
+        //Place the 24 bits at the top of an int so the sign bit lands in bit 31
+        return (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24)) / INT32_SCALE;
+    case PCM_INT32:
+        return (int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24)) / INT32_SCALE;
+    default:
+        {
+            uint32_t bits = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+            float value;
+            memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+    }
+}
+
+//clamps value*gain to [-full, full-1] and truncates toward zero, matching the vector path
+static inline int32_t saturate(double value, double gain, double full) {
+
+    double scaled = value * gain;
+    if (!(scaled < full - 1)) {
+        return (int32_t)(full - 1);
+    }
+    if (scaled <= -full) {
+        return (int32_t)(-full);
+    }
+    return (int32_t)scaled;
+}
+
+//writes value*scale as one little-endian sample
+static inline void encodeOne(double value, double scale, sampleFormat format, uint8_t *p) {
+
+    int32_t sample;
+    switch (format) {
+    case PCM_INT16:
+        sample = saturate(value, scale * INT16_SCALE, INT16_SCALE);
+        p[0] = (uint8_t)(sample & 0xFF);
+        p[1] = (uint8_t)((sample >> 8) & 0xFF);
+        break;
+    case PCM_INT24:
+        sample = saturate(value, scale * INT24_SCALE, INT24_SCALE);
+        p[0] = (uint8_t)(sample & 0xFF);
+        p[1] = (uint8_t)((sample >> 8) & 0xFF);
+        p[2] = (uint8_t)((sample >> 16) & 0xFF);
+        break;
+    case PCM_INT32:
+        sample = saturate(value, scale * INT32_SCALE, INT32_SCALE);
+        p[0] = (uint8_t)(sample & 0xFF);
+        p[1] = (uint8_t)((sample >> 8) & 0xFF);
+        p[2] = (uint8_t)((sample >> 16) & 0xFF);
+        p[3] = (uint8_t)((sample >> 24) & 0xFF);
+        break;
+    default:
+        {
+            float single = (float)(value * scale);
+            uint32_t bits;
+            memcpy(&bits, &single, sizeof(bits));
+            p[0] = (uint8_t)(bits & 0xFF);
+            p[1] = (uint8_t)((bits >> 8) & 0xFF);
+            p[2] = (uint8_t)((bits >> 16) & 0xFF);
+            p[3] = (uint8_t)((bits >> 24) & 0xFF);
+        }
+    }
+}
+
+#if defined(__SSE2__)
+
+/*
+The vector kernels below handle mono and stereo. They work on groups of
+four interleaved samples, which is four mono frames or two stereo frames;
+storeSamples and loadSamples convert between such a group and the planes
+*/
+
+//writes interleaved samples 0-1 (first) and 2-3 (second) to the planes from frame i
+static inline void storeSamples(__m128d first, __m128d second, double **planes, int channels, size_t i) {
+
+    if (channels == 1) {
+        _mm_storeu_pd(planes[0] + i, first);
+        _mm_storeu_pd(planes[0] + i + 2, second);
+    } else {
+        //Each of first and second is one frame, L in the low lane and R in the high lane
+        _mm_storeu_pd(planes[0] + i, _mm_unpacklo_pd(first, second));
+        _mm_storeu_pd(planes[1] + i, _mm_unpackhi_pd(first, second));
+    }
+}
+
+//reads the four interleaved samples starting at frame i, the inverse of storeSamples
+static inline void loadSamples(double *const *planes, int channels, size_t i, __m128d *first, __m128d *second) {
+
+    if (channels == 1) {
+        *first = _mm_loadu_pd(planes[0] + i);
+        *second = _mm_loadu_pd(planes[0] + i + 2);
+    } else {
+        __m128d left = _mm_loadu_pd(planes[0] + i);
+        __m128d right = _mm_loadu_pd(planes[1] + i);
+        *first = _mm_unpacklo_pd(left, right);
+        *second = _mm_unpackhi_pd(left, right);
+    }
+}
+
+//converts four int32 lanes to doubles times scale and stores them as interleaved samples from frame i
+static inline void storeInt32(__m128i x, __m128d scale, double **planes, int channels, size_t i) {
+
+    storeSamples(_mm_mul_pd(_mm_cvtepi32_pd(x), scale), _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(x, 8)), scale),
+                 planes, channels, i);
+}
+
+/*
+Scales four samples by gain and truncates them to int32 lanes, clamped to
+[lower, upper] like saturate. Clamping before the conversion keeps
+cvttpd from returning its out-of-range marker, and minpd returns upper
+for a NaN just as saturate does
+*/
+static inline __m128i quantize(__m128d first, __m128d second, __m128d gain, __m128d upper, __m128d lower) {
+
+    __m128i a = _mm_cvttpd_epi32(_mm_max_pd(_mm_min_pd(_mm_mul_pd(first, gain), upper), lower));
+    __m128i b = _mm_cvttpd_epi32(_mm_max_pd(_mm_min_pd(_mm_mul_pd(second, gain), upper), lower));
+    return _mm_unpacklo_epi64(a, b);
+}
+
+/*
+Vector decoders. Each handles as many whole groups as fit in frames and
+returns how many frames it converted
+*/
+static size_t decodeInt16(const uint8_t *source, size_t frames, int channels, double **planes) {
+
+    const __m128d scale = _mm_set1_pd(1.0 / INT16_SCALE);
+    size_t step = 8 / channels;
+    size_t i = 0;
+    for (; i + step <= frames; i += step) {
+        //Sign-extend the low and high four 16-bit lanes to 32 bits
+        __m128i x = _mm_loadu_si128((const __m128i *)(source + 2 * channels * i));
+        storeInt32(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16), scale, planes, channels, i);
+        storeInt32(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16), scale, planes, channels, i + step / 2);
+    }
+    return i;
+}
+
+static size_t decodeInt24(const uint8_t *source, size_t frames, int channels, double **planes) {
+
+    //Same scale as decodeOne: the 24 bits go to the top of each int32 lane
+    const __m128d scale = _mm_set1_pd(1.0 / INT32_SCALE);
+    const __m128i firstMask = _mm_set1_epi64x(0x00000000FFFFFF00LL);
+    const __m128i secondMask = _mm_set1_epi64x((long long)0xFFFFFF0000000000ULL);
+    size_t step = 4 / channels;
+    size_t total = frames * channels * 3;
+    size_t i = 0;
+
+    //Each group is 12 bytes but is read with a 16-byte load, so stop while 4 spare bytes remain
+    for (; (i + step) * channels * 3 + 4 <= total; i += step) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(source + 3 * channels * i));
+
+        //Samples 0-1 (bytes 0-5) to the low 64-bit lane, samples 2-3 (bytes 6-11) to the high one
+        __m128i pairs = _mm_unpacklo_epi64(x, _mm_srli_si128(x, 6));
+
+        //Within each lane move sample 0 to bits 8-31 and sample 1 to bits 40-63
+        __m128i lanes = _mm_or_si128(_mm_and_si128(_mm_slli_epi64(pairs, 8), firstMask),
+                                     _mm_and_si128(_mm_slli_epi64(pairs, 16), secondMask));
+        storeInt32(lanes, scale, planes, channels, i);
+    }
+    return i;
+}
+
+static size_t decodeInt32(const uint8_t *source, size_t frames, int channels, double **planes) {
+
+    const __m128d scale = _mm_set1_pd(1.0 / INT32_SCALE);
+    size_t step = 4 / channels;
+    size_t i = 0;
+    for (; i + step <= frames; i += step) {
+        storeInt32(_mm_loadu_si128((const __m128i *)(source + 4 * channels * i)), scale, planes, channels, i);
+    }
+    return i;
+}
+
+static size_t decodeFloat(const uint8_t *source, size_t frames, int channels, double **planes) {
+
+    size_t step = 4 / channels;
+    size_t i = 0;
+    for (; i + step <= frames; i += step) {
+        __m128 x = _mm_loadu_ps((const float *)(source + 4 * channels * i));
+        storeSamples(_mm_cvtps_pd(x), _mm_cvtps_pd(_mm_movehl_ps(x, x)), planes, channels, i);
+    }
+    return i;
+}
+
+/*
+Vector encoders, the inverse of the decoders above, saturating the
+integer formats exactly like encodeOne
+*/
+static size_t encodeInt16(double *const *planes, int channels, size_t frames, double scale, uint8_t *destination) {
+
+    const __m128d gain = _mm_set1_pd(scale * INT16_SCALE);
+    const __m128d upper = _mm_set1_pd(INT16_SCALE - 1);
+    const __m128d lower = _mm_set1_pd(-INT16_SCALE);
+    size_t step = 8 / channels;
+    size_t i = 0;
+    for (; i + step <= frames; i += step) {
+        __m128d first;
+        __m128d second;
+        loadSamples(planes, channels, i, &first, &second);
+        __m128i low = quantize(first, second, gain, upper, lower);
+        loadSamples(planes, channels, i + step / 2, &first, &second);
+        __m128i high = quantize(first, second, gain, upper, lower);
+
+        //The values are already in range, so packs only narrows them
+        _mm_storeu_si128((__m128i *)(destination + 2 * channels * i), _mm_packs_epi32(low, high));
+    }
+    return i;
+}
+
+static size_t encodeInt24(double *const *planes, int channels, size_t frames, double scale, uint8_t *destination) {
+
+    const __m128d gain = _mm_set1_pd(scale * INT24_SCALE);
+    const __m128d upper = _mm_set1_pd(INT24_SCALE - 1);
+    const __m128d lower = _mm_set1_pd(-INT24_SCALE);
+    const __m128i firstMask = _mm_set1_epi64x(0x0000000000FFFFFFLL);
+    const __m128i secondMask = _mm_set1_epi64x(0x0000FFFFFF000000LL);
+    const __m128i lowLane = _mm_set_epi32(0, 0, -1, -1);
+    size_t step = 4 / channels;
+    size_t i = 0;
+    for (; i + step <= frames; i += step) {
+        __m128d first;
+        __m128d second;
+        loadSamples(planes, channels, i, &first, &second);
+        __m128i x = quantize(first, second, gain, upper, lower);
+
+        //Within each 64-bit lane pack the two samples' low 24 bits into 6 bytes,
+        //then slide the high lane down so the 12 bytes are contiguous
+        __m128i pairs = _mm_or_si128(_mm_and_si128(x, firstMask), _mm_and_si128(_mm_srli_epi64(x, 8), secondMask));
+        __m128i packed = _mm_or_si128(_mm_and_si128(pairs, lowLane), _mm_srli_si128(_mm_andnot_si128(lowLane, pairs), 2));
+
+        uint8_t *p = destination + 3 * channels * i;
+        _mm_storel_epi64((__m128i *)p, packed);
+        uint32_t tail = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+        memcpy(p + 8, &tail, sizeof(tail));
+    }
+    return i;
+}
+
+static size_t encodeInt32(double *const *planes, int channels, size_t frames, double scale, uint8_t *destination) {
+
+    const __m128d gain = _mm_set1_pd(scale * INT32_SCALE);
+    const __m128d upper = _mm_set1_pd(INT32_SCALE - 1);
+    const __m128d lower = _mm_set1_pd(-INT32_SCALE);
+    size_t step = 4 / channels;
+    size_t i = 0;
+    for (; i + step <= frames; i += step) {
+        __m128d first;
+        __m128d second;
+        loadSamples(planes, channels, i, &first, &second);
+        _mm_storeu_si128((__m128i *)(destination + 4 * channels * i), quantize(first, second, gain, upper, lower));
+    }
+    return i;
+}
+
+static size_t encodeFloat(double *const *planes, int channels, size_t frames, double scale, uint8_t *destination) {
+
+    const __m128d gain = _mm_set1_pd(scale);
+    size_t step = 4 / channels;
+    size_t i = 0;
+    for (; i + step <= frames; i += step) {
+        __m128d first;
+        __m128d second;
+        loadSamples(planes, channels, i, &first, &second);
+        __m128 x = _mm_movelh_ps(_mm_cvtpd_ps(_mm_mul_pd(first, gain)), _mm_cvtpd_ps(_mm_mul_pd(second, gain)));
+        _mm_storeu_ps((float *)(destination + 4 * channels * i), x);
+    }
+    return i;
+}
+
+#endif
+
+/*
+Converts frames of interleaved samples to doubles, writing channel c
+of frame i to planes[c][i]
+*/
+void decodeSamples(const uint8_t *source, sampleFormat format, size_t frames, int channels, double **planes) {
+
+    size_t done = 0;
+#if defined(__SSE2__)
+    if (channels == 1 || channels == 2) {
+        switch (format) {
+        case PCM_INT16:
+            done = decodeInt16(source, frames, channels, planes);
+            break;
+        case PCM_INT24:
+            done = decodeInt24(source, frames, channels, planes);
+            break;
+        case PCM_INT32:
+            done = decodeInt32(source, frames, channels, planes);
+            break;
+        default:
+            done = decodeFloat(source, frames, channels, planes);
+        }
+    }
+#endif
+
+    int width = bytesPerSample(format);
+    size_t frameSize = (size_t)width * channels;
+    for (size_t i = done; i < frames; i++) {
+        const uint8_t *frame = source + i * frameSize;
+        for (int c = 0; c < channels; c++) {
+            planes[c][i] = decodeOne(frame + c * width, format);
+        }
+    }
+}
+
+/*
+Converts frames of planar doubles, each multiplied by scale, to
+interleaved samples of the given format
+*/
+void encodeSamples(double *const *planes, int channels, size_t frames, double scale, sampleFormat format, uint8_t *destination) {
+
+    size_t done = 0;
+#if defined(__SSE2__)
+    if (channels == 1 || channels == 2) {
+        switch (format) {
+        case PCM_INT16:
+            done = encodeInt16(planes, channels, frames, scale, destination);
+            break;
+        case PCM_INT24:
+            done = encodeInt24(planes, channels, frames, scale, destination);
+            break;
+        case PCM_INT32:
+            done = encodeInt32(planes, channels, frames, scale, destination);
+            break;
+        default:
+            done = encodeFloat(planes, channels, frames, scale, destination);
+        }
+    }
+#endif
+
+    int width = bytesPerSample(format);
+    size_t frameSize = (size_t)width * channels;
+    for (size_t i = done; i < frames; i++) {
+        uint8_t *frame = destination + i * frameSize;
+        for (int c = 0; c < channels; c++) {
+            encodeOne(planes[c][i], scale, format, frame + c * width);
+        }
+    }
+}
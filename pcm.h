@@ -0,0 +1,21 @@
+#ifndef PCM_H
+#define PCM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//sample encodings that can be read from and written to wav files
+enum sampleFormat
+{
+    PCM_INT16,
+    PCM_INT24,
+    PCM_INT32,
+    PCM_FLOAT32
+};
+
+int bytesPerSample(sampleFormat format);
+
+void decodeSamples(const uint8_t *source, sampleFormat format, size_t frames, int channels, double **planes);
+void encodeSamples(double *const *planes, int channels, size_t frames, double scale, sampleFormat format, uint8_t *destination);
+
+#endif
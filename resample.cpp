@@ -0,0 +1,204 @@
+/*
+	Polyphase sample-rate conversion
+
+	Converts between any two integer sample rates whose ratio reduces to
+	upFactor/downFactor with upFactor <= RESAMPLE_MAX_PHASES (every pair of
+	the usual 44.1/48/88.2/96 kHz rates qualifies). Conceptually the signal is
+	zero-stuffed by upFactor, low-pass filtered and decimated by downFactor;
+	the polyphase form only evaluates the filter taps that land on real input
+	samples, so each output sample costs one short dot product.
+
+	The passband runs flat to PASSBAND of the lower Nyquist frequency and the
+	stopband starts at that Nyquist frequency, so nothing above it folds
+	back into the output. Between the two the response rolls off, with the
+	-6 dB point halfway. From 96 to 44.1 kHz that puts the passband edge at
+	20.1 kHz, and everything from 22.05 kHz up is at least 85 dB down
+*/
+
+#include <math.h>
+#include <vector>
+#include "resample.h"
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Shape parameter of the Kaiser window (about 85 dB of stopband attenuation)
+#define KAISER_BETA			8.6
+
+// Passband edge as a fraction of the lower of the two Nyquist frequencies
+#define PASSBAND			0.91
+
+using namespace std;
+
+static int greatestCommonDivisor(int a, int b) {
+
+    while (b != 0) {
+        int remainder = a % b;
+        a = b;
+        b = remainder;
+    }
+    return a;
+}
+
+//zeroth order modified Bessel function of the first kind, used by the Kaiser window
+static double besselI0(double x) {
+
+    double sum = 1;
+    double term = 1;
+    for (int k = 1; k < 50; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-17) {
+            break;
+        }
+    }
+    return sum;
+}
+
+/*
+Dot product of count doubles, count a multiple of 8. Uses AVX or SSE2 when
+the compiler targets them, with independent accumulators so the adds can
+overlap
+*/
+static inline double dotProduct(const double *a, const double *b, int count) {
+
+#if defined(__AVX__)
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    for (int k = 0; k < count; k += 8) {
+        sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(_mm256_loadu_pd(a + k), _mm256_loadu_pd(b + k)));
+        sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(_mm256_loadu_pd(a + k + 4), _mm256_loadu_pd(b + k + 4)));
+    }
+    sum0 = _mm256_add_pd(sum0, sum1);
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum0), _mm256_extractf128_pd(sum0, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+#elif defined(__SSE2__)
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    __m128d sum2 = _mm_setzero_pd();
+    __m128d sum3 = _mm_setzero_pd();
+    for (int k = 0; k < count; k += 8) {
+        sum0 = _mm_add_pd(sum0, _mm_mul_pd(_mm_loadu_pd(a + k), _mm_loadu_pd(b + k)));
+        sum1 = _mm_add_pd(sum1, _mm_mul_pd(_mm_loadu_pd(a + k + 2), _mm_loadu_pd(b + k + 2)));
+        sum2 = _mm_add_pd(sum2, _mm_mul_pd(_mm_loadu_pd(a + k + 4), _mm_loadu_pd(b + k + 4)));
+        sum3 = _mm_add_pd(sum3, _mm_mul_pd(_mm_loadu_pd(a + k + 6), _mm_loadu_pd(b + k + 6)));
+    }
+    __m128d half = _mm_add_pd(_mm_add_pd(sum0, sum1), _mm_add_pd(sum2, sum3));
+    return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+#else
+    double sum[4] = {0, 0, 0, 0};
+    for (int k = 0; k < count; k += 4) {
+        sum[0] += a[k] * b[k];
+        sum[1] += a[k + 1] * b[k + 1];
+        sum[2] += a[k + 2] * b[k + 2];
+        sum[3] += a[k + 3] * b[k + 3];
+    }
+    return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+#endif
+}
+
+/*
+Designs the Kaiser-windowed sinc low-pass for converting inputRate to
+outputRate and splits it into polyphase branches. Returns false if the
+rate ratio needs more than RESAMPLE_MAX_PHASES branches or branches longer
+than RESAMPLE_MAX_TAPS
+*/
+bool makePolyphaseFilter(int inputRate, int outputRate, polyphaseFilter *filter) {
+
+    if (inputRate <= 0 || outputRate <= 0) {
+        return false;
+    }
+
+    int divisor = greatestCommonDivisor(inputRate, outputRate);
+    int up = outputRate / divisor;
+    int down = inputRate / divisor;
+    if (up > RESAMPLE_MAX_PHASES) {
+        return false;
+    }
+
+    //Each branch spans the same stretch of time at the lower rate however far we decimate
+    long long branch = ((long long)RESAMPLE_TAPS * max(up, down) / up + 7) / 8 * 8;
+    if (branch > RESAMPLE_MAX_TAPS) {
+        return false;
+    }
+    int taps = (int)branch;
+
+    filter->upFactor = up;
+    filter->downFactor = down;
+    filter->tapsPerPhase = taps;
+    filter->taps.assign((size_t)up * taps, 0);
+
+    //Cutoff in cycles per sample of the zero-stuffed signal, midway between
+    //the passband edge and the lower Nyquist frequency
+    int length = up * taps;
+    double center = (length - 1) / 2.0;
+    double cutoff = (PASSBAND + 1) / 2 * 0.5 / max(up, down);
+    double windowNorm = besselI0(KAISER_BETA);
+
+    for (int t = 0; t < length; t++) {
+        double x = t - center;
+        double sinc = (x == 0) ? 1 : sin(M_PI * 2 * cutoff * x) / (M_PI * 2 * cutoff * x);
+        double r = x / (center + 0.5);
+        double window = besselI0(KAISER_BETA * sqrt(max(0.0, 1 - r * r))) / windowNorm;
+
+        //The factor of up restores the gain lost to zero-stuffing
+        double h = up * 2 * cutoff * sinc * window;
+
+        //Branch p holds taps p, p + up, p + 2up, ... stored in reverse so that
+        //the dot product walks the input forwards
+        int phase = t % up;
+        int k = t / up;
+        filter->taps[(size_t)phase * taps + (taps - 1 - k)] = h;
+    }
+    return true;
+}
+
+/*
+Resamples input with a filter from makePolyphaseFilter. The output is
+aligned with the input (the filter delay is compensated) and has
+ceil(input.size() * upFactor / downFactor) samples
+*/
+std::vector<double> resample(std::vector<double> const& input, polyphaseFilter const& filter) {
+
+    long long up = filter.upFactor;
+    long long down = filter.downFactor;
+    long long inputSize = input.size();
+    long long outputSize = (inputSize * up + down - 1) / down;
+    long long taps = filter.tapsPerPhase;
+    long long delay = (up * taps - 1) / 2;
+
+    std::vector<double> output(outputSize);
+    if (outputSize == 0) {
+        return output;
+    }
+
+    //Zero padding on both sides lets the inner loop run without bounds checks
+    long long lastBase = ((outputSize - 1) * down + delay) / up;
+    std::vector<double> padded(lastBase + taps, 0);
+    for (long long i = 0; i < inputSize && i + taps - 1 < (long long)padded.size(); i++) {
+        padded[i + taps - 1] = input[i];
+    }
+
+    const double *coefficients = filter.taps.data();
+    for (long long m = 0; m < outputSize; m++) {
+        long long position = m * down + delay;
+        long long base = position / up;
+        long long phase = position % up;
+        output[m] = dotProduct(coefficients + phase * taps, &padded[base], (int)taps);
+    }
+    return output;
+}
+
+/*
+Convenience wrapper that designs the filter and resamples in one call.
+Returns the input unchanged if the rates match or the ratio is unsupported
+*/
+std::vector<double> resample(std::vector<double> const& input, int inputRate, int outputRate) {
+
+    polyphaseFilter filter;
+    if (inputRate == outputRate || !makePolyphaseFilter(inputRate, outputRate, &filter)) {
+        return input;
+    }
+    return resample(input, filter);
+}
@@ -0,0 +1,32 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <vector>
+
+// Filter taps per polyphase branch when upsampling, a multiple of 8. Enough
+// for the Kaiser window to fall from the passband edge to full stopband
+// attenuation by the lower Nyquist frequency. Decimating by down/up
+// lengthens each branch by that factor, so the transition band keeps its
+// width at the lower of the two rates
+#define RESAMPLE_TAPS		128
+
+// Longest branch allowed, which limits decimation to a factor of 32
+#define RESAMPLE_MAX_TAPS	4096
+
+// Largest interpolation factor supported (outputRate / gcd of the two rates)
+#define RESAMPLE_MAX_PHASES	4096
+
+//one branch of tapsPerPhase coefficients per output phase
+struct polyphaseFilter
+{
+    int                     upFactor;
+    int                     downFactor;
+    int                     tapsPerPhase;
+    std::vector<double>     taps;
+};
+
+bool makePolyphaseFilter(int inputRate, int outputRate, polyphaseFilter *filter);
+std::vector<double> resample(std::vector<double> const& input, polyphaseFilter const& filter);
+std::vector<double> resample(std::vector<double> const& input, int inputRate, int outputRate);
+
+#endif
@@ -0,0 +1,290 @@
+/*
+	Sharded rendering of long inputs across worker processes
+
+	The coordinator splits the input into equal time segments and starts one
+	worker process per segment:
+
+	    FFTconvolve --shard-worker input ir start count rawFile
+
+	Each worker reads only its own frames, convolves them with the whole IR
+	and writes the full linear result (count + irLength - 1 frames) to
+	rawFile. The coordinator then overlap-adds the segment results at their
+	start offsets, which reproduces the single-process convolution up to
+	floating-point reassociation. With --hosts the workers are started
+	round-robin through ssh instead; the remote hosts must see the input, IR
+	and output directory at the same absolute paths, which is how they are
+	passed, and share this byte order.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "complex_functions.h"
+#include "shard.h"
+
+// Largest difference from a single-process render, relative to its peak, that --verify accepts
+#define SHARD_TOLERANCE		1e-9
+
+using namespace std;
+
+/*
+Segment results are stored as the channel count, the frame count, then
+each channel's doubles in turn
+*/
+bool writeShardFile(std::vector<std::vector<double>> const& channels, char *rawFilename) {
+
+    FILE *rawFile = fopen(rawFilename, "wb");
+    if (rawFile == nullptr) {
+        return false;
+    }
+    long long frames = channels.empty() ? 0 : channels[0].size();
+    fwriteIntLSB(channels.size(), rawFile);
+    fwriteLongLSB(frames, rawFile);
+    bool written = true;
+    for (size_t c = 0; c < channels.size(); c++) {
+        written = written && fwrite(channels[c].data(), sizeof(double), frames, rawFile) == (size_t)frames;
+    }
+    return fclose(rawFile) == 0 && written;
+}
+
+/*
+Adds the segment stored in rawFilename into output at frame offset start,
+dropping anything past the end of output
+*/
+bool addShardFile(const char *rawFilename, long long start, std::vector<std::vector<double>> &output) {
+
+    FILE *rawFile = fopen(rawFilename, "rb");
+    if (rawFile == nullptr) {
+        return false;
+    }
+    int channels = freadIntLSB(rawFile);
+    long long frames = freadLongLSB(rawFile);
+    if (channels != (int)output.size() || frames < 0) {
+        fclose(rawFile);
+        return false;
+    }
+
+    long long outputFrames = output[0].size();
+    std::vector<double> segment(frames);
+    for (int c = 0; c < channels; c++) {
+        if (fread(segment.data(), sizeof(double), frames, rawFile) != (size_t)frames) {
+            fclose(rawFile);
+            return false;
+        }
+        for (long long i = 0; i < frames && start + i < outputFrames; i++) {
+            output[c][start + i] += segment[i];
+        }
+    }
+    fclose(rawFile);
+    return true;
+}
+
+int runShardWorker(char *inputFilename, char *irFilename, long long start, long long count, char *rawFilename) {
+
+    FILE *inputFile = fopen(inputFilename, "rb");
+    wavInfo input;
+    if (inputFile == nullptr || !readWavFileHeader(&input, inputFile)) {
+        fprintf(stderr, "Unable to read wav file: %s\n", inputFilename);
+        return 1;
+    }
+
+    std::vector<std::vector<double>> irChannels;
+    if (!loadIRFile(irFilename, input.sampleRate, &irChannels)) {
+        return 1;
+    }
+
+    std::vector<std::vector<double>> segment = readWavFrames(input, inputFilename, start, count);
+    int linearSize = segment[0].size() + irChannels[0].size() - 1;
+    std::vector<std::vector<double>> result = convolveChannels(segment, irChannels, linearSize);
+
+    if (!writeShardFile(result, rawFilename)) {
+        fprintf(stderr, "Unable to write shard file: %s\n", rawFilename);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+Returns path made absolute with realpath. A path that does not exist yet,
+such as a shard file, has its directory resolved instead. Falls back to
+path itself if neither can be resolved
+*/
+static std::string absolutePath(const char *path) {
+
+    char resolved[PATH_MAX];
+    if (realpath(path, resolved) != nullptr) {
+        return resolved;
+    }
+
+    //dirname and basename may modify their argument, so each gets a copy
+    std::string directoryCopy = path;
+    std::string nameCopy = path;
+    if (realpath(dirname(&directoryCopy[0]), resolved) == nullptr) {
+        return path;
+    }
+    std::string directory = resolved;
+    return directory + (directory == "/" ? "" : "/") + basename(&nameCopy[0]);
+}
+
+//wraps text in single quotes for a POSIX shell, so ssh's remote shell passes it through as one argument
+static std::string shellQuote(std::string const& text) {
+
+    std::string quoted = "'";
+    for (char c : text) {
+        if (c == '\'') {
+            quoted += "'\\''";
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "'";
+}
+
+/*
+Starts one worker process and returns its pid, or -1 if it could not be
+started. host is nullptr for a local worker
+*/
+static pid_t startWorker(char *self, const char *host, std::string const& inputFilename, std::string const& irFilename,
+                         long long start, long long count, std::string const& rawFilename) {
+
+    std::string startText = to_string(start);
+    std::string countText = to_string(count);
+
+    //ssh joins its arguments into one line for the remote shell, so each is quoted here
+    std::string command;
+    if (host != nullptr) {
+        const std::string arguments[] = {self, "--shard-worker", inputFilename, irFilename, startText, countText, rawFilename};
+        for (std::string const& argument : arguments) {
+            command += (command.empty() ? "" : " ") + shellQuote(argument);
+        }
+    }
+
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    if (host == nullptr) {
+        execl("/proc/self/exe", self, "--shard-worker", inputFilename.c_str(), irFilename.c_str(),
+              startText.c_str(), countText.c_str(), rawFilename.c_str(), (char *)nullptr);
+    } else {
+        execlp("ssh", "ssh", host, command.c_str(), (char *)nullptr);
+    }
+    perror("exec");
+    _exit(127);
+}
+
+/*
+Renders inputFilename in shards worker processes and writes the stitched
+result like renderFile. hosts is a comma-separated list of ssh hosts, or
+nullptr to run every worker locally. With verify set the whole file is
+also rendered in this process and the largest difference is reported
+against SHARD_TOLERANCE
+*/
+int renderSharded(char *self, char *inputFilename, char *irFilename, char *outputFilename, int shards,
+                  char *hosts, bool verify, int outputRate, sampleFormat *outputFormat) {
+
+    FILE *inputFile = fopen(inputFilename, "rb");
+    wavInfo input;
+    printf("Reading wav file %s...\n", inputFilename);
+    if (inputFile == nullptr || !readWavFileHeader(&input, inputFile)) {
+        fprintf(stderr, "Unable to read wav file: %s\n", inputFilename);
+        return 1;
+    }
+
+    printf("Reading IR file %s...\n", irFilename);
+    std::vector<std::vector<double>> irChannels;
+    if (!loadIRFile(irFilename, input.sampleRate, &irChannels)) {
+        return 1;
+    }
+
+    std::vector<std::string> hostList;
+    if (hosts != nullptr) {
+        std::string remaining = hosts;
+        size_t comma;
+        while ((comma = remaining.find(',')) != std::string::npos) {
+            hostList.push_back(remaining.substr(0, comma));
+            remaining = remaining.substr(comma + 1);
+        }
+        hostList.push_back(remaining);
+    }
+
+    //Remote workers start in the remote home directory, so every path they
+    //are given must be absolute
+    std::string selfPath = absolutePath(self);
+    std::string inputPath = absolutePath(inputFilename);
+    std::string irPath = absolutePath(irFilename);
+    std::string outputPath = absolutePath(outputFilename);
+
+    shards = max(1, (int)min((long long)shards, input.frames));
+    long long segment = (input.frames + shards - 1) / shards;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+    std::vector<pid_t> workers;
+    std::vector<std::string> rawFilenames;
+    for (int s = 0; s < shards; s++) {
+        rawFilenames.push_back(outputPath + ".shard" + to_string(s) + ".raw");
+        const char *host = hostList.empty() ? nullptr : hostList[s % hostList.size()].c_str();
+        workers.push_back(startWorker(&selfPath[0], host, inputPath, irPath,
+                                      s * segment, segment, rawFilenames[s]));
+    }
+
+    bool failed = false;
+    for (int s = 0; s < shards; s++) {
+        int status = 0;
+        if (workers[s] < 0 || waitpid(workers[s], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Shard %d failed\n", s);
+            failed = true;
+        }
+    }
+
+    //Overlap-add each segment's result, tail included, at its start offset
+    long long maxSize = max(input.frames, (long long)irChannels[0].size());
+    std::vector<std::vector<double>> outputChannels(input.channels, std::vector<double>(maxSize));
+    for (int s = 0; s < shards && !failed; s++) {
+        if (!addShardFile(rawFilenames[s].c_str(), s * segment, outputChannels)) {
+            fprintf(stderr, "Unable to read shard file: %s\n", rawFilenames[s].c_str());
+            failed = true;
+        }
+    }
+    for (int s = 0; s < shards; s++) {
+        remove(rawFilenames[s].c_str());
+    }
+    if (failed) {
+        return 1;
+    }
+
+    double elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    printf("Rendered %d shards in %.1f ms\n", shards, elapsedMs);
+
+    if (verify) {
+        std::vector<std::vector<double>> inputChannels = readWavFile(input, inputFilename);
+        std::vector<std::vector<double>> single = convolveChannels(inputChannels, irChannels, maxSize);
+
+        double peak = 0;
+        double difference = 0;
+        for (int c = 0; c < input.channels; c++) {
+            for (long long i = 0; i < maxSize; i++) {
+                peak = max(peak, fabs(single[c][i]));
+                difference = max(difference, fabs(single[c][i] - outputChannels[c][i]));
+            }
+        }
+        double relative = peak > 0 ? difference / peak : difference;
+        printf("Max difference from single-process render: %g (%g of peak, tolerance %g) %s\n",
+               difference, relative, SHARD_TOLERANCE, relative <= SHARD_TOLERANCE ? "PASS" : "FAIL");
+        failed = relative > SHARD_TOLERANCE;
+    }
+
+    writeOutput(outputChannels, input, outputRate, outputFormat, outputFilename);
+
+    printf("Finished\n");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,13 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <vector>
+#include "pcm.h"
+
+int renderSharded(char *self, char *inputFilename, char *irFilename, char *outputFilename, int shards,
+                  char *hosts, bool verify, int outputRate, sampleFormat *outputFormat);
+int runShardWorker(char *inputFilename, char *irFilename, long long start, long long count, char *rawFilename);
+bool writeShardFile(std::vector<std::vector<double>> const& channels, char *rawFilename);
+bool addShardFile(const char *rawFilename, long long start, std::vector<std::vector<double>> &output);
+
+#endif
@@ -0,0 +1,191 @@
+/*
+	Real-time stress test for the block engine
+
+	Usage: ./FFTconvolve --rt-stress inputFile irFile blockSize [loadThreads]
+
+	Plays inputFile through a blockConvolver as an audio callback would: the
+	driver sleeps until each block's buffer would be due, processes it, and
+	measures both the time inside processBlock and the response time from
+	the moment the block was due to the moment its output was ready. Each
+	block has blockSize / sampleRate seconds before the next one is due, and
+	any response longer than that is an overrun the listener would hear.
+
+	Meanwhile loadThreads spinner threads keep every core busy with
+	arithmetic and cache-sized memory sweeps, and halfway through the IR is
+	restaged so the crossfade, the engine's most expensive block, is part
+	of the measurement. Blocks are processed on a dedicated audio thread
+	that asks for SCHED_FIFO like a real host; without the privilege it
+	carries on at normal priority and says so. The calling thread plays the
+	host at normal priority: it stages the new IR and frees retired ones,
+	so neither the load nor the thread creation lands on the audio thread.
+
+	The configuration is reported safe when no block overran and the worst
+	response left at least 1 - RT_HEADROOM of the deadline to spare
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "complex_functions.h"
+#include "partitioned.h"
+#include "latency.h"
+#include "stress.h"
+
+// Largest share of the deadline the worst block may use and still count as safe
+#define RT_HEADROOM			0.75
+
+// Memory each spinner sweeps, enough to push the audio thread's data out of shared caches
+#define SPINNER_BYTES		(4 * 1024 * 1024)
+
+using namespace std;
+
+/*
+Burns CPU and memory bandwidth until running is cleared
+*/
+static void spin(std::atomic<bool> *running) {
+
+    std::vector<double> memory(SPINNER_BYTES / sizeof(double), 1.0);
+    volatile double sink = 0;
+    while (running->load(std::memory_order_relaxed)) {
+        double sum = 0;
+        for (size_t i = 0; i < memory.size(); i += 8) {
+            memory[i] = memory[i] * 1.0000001 + 1e-9;
+            sum += memory[i];
+        }
+        sink = sink + sum;
+    }
+}
+
+//asks for the real-time scheduling class a live audio thread would run in
+static bool raisePriority() {
+
+    sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+}
+
+/*
+Runs the stress test described above and prints both histograms and a
+verdict. Returns 0 if the configuration is safe, 1 if it is not or the
+files could not be read
+*/
+int runRealtimeStress(char *inputFilename, char *irFilename, int blockSize, int loadThreads) {
+
+    wavInfo input;
+    std::vector<std::vector<double>> inputChannels;
+    std::vector<std::vector<double>> irChannels;
+
+    printf("Reading wav file %s...\n", inputFilename);
+    if (!loadWavFile(inputFilename, &input, &inputChannels)) {
+        return 1;
+    }
+    printf("Reading IR file %s...\n", irFilename);
+    if (!loadIRFile(irFilename, input.sampleRate, &irChannels)) {
+        return 1;
+    }
+
+    blockSize = nextPowerOfTwo(max(blockSize, 1));
+    int irSize = irChannels[0].size();
+    int totalSize = inputChannels[0].size() + irSize;
+    int maxPartitions = 2 * ((irSize + blockSize - 1) / blockSize) + 1;
+    std::chrono::nanoseconds period((long long)(blockSize * 1e9 / input.sampleRate));
+
+    blockConvolver engine;
+    initBlockConvolver(&engine, blockSize, input.channels, input.sampleRate, maxPartitions, CROSSFADE_BLOCKS);
+    setIR(&engine, irChannels);
+
+    latencyHistogram *processing = new latencyHistogram;
+    latencyHistogram *response = new latencyHistogram;
+    initLatencyHistogram(processing, period.count());
+    initLatencyHistogram(response, period.count());
+    engine.timing = processing;
+
+    std::vector<std::vector<double>> inputBlock(input.channels, std::vector<double>(blockSize));
+    std::vector<std::vector<double>> outputBlock(input.channels, std::vector<double>(blockSize));
+    std::vector<double *> inputPlanes(input.channels);
+    std::vector<double *> outputPlanes(input.channels);
+    for (int c = 0; c < input.channels; c++) {
+        inputPlanes[c] = inputBlock[c].data();
+        outputPlanes[c] = outputBlock[c].data();
+    }
+
+    if (loadThreads < 0) {
+        loadThreads = std::thread::hardware_concurrency();
+    }
+    std::atomic<bool> running(true);
+    std::vector<std::thread> spinners;
+    for (int i = 0; i < loadThreads; i++) {
+        spinners.push_back(std::thread(spin, &running));
+    }
+
+    int switchBlock = (totalSize / blockSize) / 2;
+    std::atomic<int> blocksDone(0);
+    std::atomic<bool> playing(true);
+    std::thread audio([&]() {
+        bool realtime = raisePriority();
+        printf("Replaying %.2f s in %d-sample blocks at %d Hz (deadline %.1f us) with %d load thread(s), %s priority\n",
+               totalSize / (double)input.sampleRate, blockSize, input.sampleRate, period.count() / 1000.0,
+               loadThreads, realtime ? "SCHED_FIFO" : "normal");
+
+        auto due = std::chrono::steady_clock::now() + period;
+        for (int start = 0; start < totalSize; start += blockSize) {
+            for (int c = 0; c < input.channels; c++) {
+                int available = max(0, min(blockSize, (int)inputChannels[c].size() - start));
+                std::fill(inputBlock[c].begin(), inputBlock[c].end(), 0.0);
+                std::copy(inputChannels[c].begin() + start, inputChannels[c].begin() + start + available, inputBlock[c].begin());
+            }
+
+            std::this_thread::sleep_until(due);
+            processBlock(&engine, inputPlanes.data(), outputPlanes.data());
+            auto finished = std::chrono::steady_clock::now();
+            recordLatency(response, std::chrono::duration_cast<std::chrono::nanoseconds>(finished - due).count());
+            due += period;
+            blocksDone.fetch_add(1, std::memory_order_release);
+        }
+        playing.store(false);
+    });
+
+    //Host work at normal priority, polled once per block as a host's housekeeping timer would
+    bool staged = false;
+    while (playing.load()) {
+        collectRetiredIR(&engine);
+        if (!staged && blocksDone.load(std::memory_order_acquire) >= switchBlock) {
+            stageIRFile(&engine, irFilename);
+            staged = true;
+        }
+        std::this_thread::sleep_for(period);
+    }
+    audio.join();
+
+    running.store(false);
+    for (std::thread &spinner : spinners) {
+        spinner.join();
+    }
+    destroyBlockConvolver(&engine);
+
+    printLatencyReport(processing, "processBlock time");
+    printLatencyReport(response, "Response time from block due to output ready");
+
+    uint64_t overruns = response->overruns.load();
+    int64_t worst = response->maximum.load();
+    bool safe = overruns == 0 && worst <= RT_HEADROOM * period.count();
+    if (safe) {
+        printf("SAFE: worst block used %.1f%% of the deadline\n", 100.0 * worst / period.count());
+    } else if (overruns > 0) {
+        printf("UNSAFE: %llu of %llu blocks missed the deadline\n",
+               (unsigned long long)overruns, (unsigned long long)response->total.load());
+    } else {
+        printf("UNSAFE: worst block used %.1f%% of the deadline, more than the %.0f%% allowed\n",
+               100.0 * worst / period.count(), 100 * RT_HEADROOM);
+    }
+
+    delete processing;
+    delete response;
+    return safe ? 0 : 1;
+}
@@ -0,0 +1,6 @@
+#ifndef STRESS_H
+#define STRESS_H
+
+int runRealtimeStress(char *inputFilename, char *irFilename, int blockSize, int loadThreads);
+
+#endif